@@ -0,0 +1,66 @@
+/* Compares path::list_dir (opendir/readdir) with path::scan_dir (getdents64
+ * into a caller sized buffer) on a directory with lots of entries.
+ *
+ *   bench_list_dir [entry_count] [directory]
+ */
+
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+
+#include "kfs/kfs.h"
+
+template<typename Func>
+static double time_ms(Func func, int repeats=5) {
+    double best = 0;
+    for(int i = 0; i < repeats; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        func();
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        if(i == 0 || elapsed.count() < best) {
+            best = elapsed.count();
+        }
+    }
+    return best;
+}
+
+int main(int argc, char* argv[]) {
+    int count = (argc > 1) ? std::atoi(argv[1]) : 200000;
+    kfs::Path dir = (argc > 2) ? kfs::Path(argv[2]) : kfs::path::join(kfs::temp_dir(), "kfs_bench_list_dir");
+
+    if(!kfs::path::exists(dir) || kfs::path::list_dir(dir).size() != std::size_t(count)) {
+        if(kfs::path::exists(dir)) {
+            kfs::remove_dirs(dir);
+        } else {
+            kfs::make_dirs(dir);
+        }
+
+        for(int i = 0; i < count; ++i) {
+            std::ofstream(kfs::path::join(dir, "entry_" + std::to_string(i)).c_str());
+        }
+    }
+
+    std::size_t seen = 0;
+    std::cout << "Directory with " << count << " entries" << std::endl;
+
+    std::cout << "  list_dir:            " << time_ms([&]() {
+        seen = kfs::path::list_dir(dir).size();
+    }) << "ms" << std::endl;
+
+    for(std::size_t size: {32 * 1024, 1024 * 1024, 4 * 1024 * 1024}) {
+        std::cout << "  scan_dir (" << size / 1024 << "KiB):" << std::string(8 - std::to_string(size / 1024).size(), ' ') << time_ms([&]() {
+            seen = kfs::path::scan_dir(dir, size).size();
+        }) << "ms" << std::endl;
+
+        std::cout << "  DirReader (" << size / 1024 << "KiB):" << std::string(7 - std::to_string(size / 1024).size(), ' ') << time_ms([&]() {
+            kfs::DirReader reader(dir, size);
+            seen = 0;
+            while(reader.next()) {
+                ++seen;
+            }
+        }) << "ms" << std::endl;
+    }
+
+    return (seen == std::size_t(count)) ? 0 : 1;
+}
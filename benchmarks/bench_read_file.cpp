@@ -0,0 +1,69 @@
+/* Compares reading a large file through an ifstream (the way
+ * path::read_file_contents does it) with read_file_parallel.
+ *
+ *   bench_read_file [size_mb] [file]
+ *
+ * Unless the file is dropped from the page cache between runs this mostly
+ * measures memcpy, so it's best pointed at a file bigger than RAM or run
+ * after echo 3 > /proc/sys/vm/drop_caches.
+ */
+
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+
+#include "kfs/kfs.h"
+
+template<typename Func>
+static double time_ms(Func func, int repeats=3) {
+    double best = 0;
+    for(int i = 0; i < repeats; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        func();
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        if(i == 0 || elapsed.count() < best) {
+            best = elapsed.count();
+        }
+    }
+    return best;
+}
+
+int main(int argc, char* argv[]) {
+    std::size_t size = std::size_t((argc > 1) ? std::atoi(argv[1]) : 512) * 1024 * 1024;
+    kfs::Path file = (argc > 2) ? kfs::Path(argv[2]) : kfs::path::join(kfs::temp_dir(), "kfs_bench_read_file");
+
+    if(!kfs::path::exists(file) || std::size_t(kfs::lstat(file).first.size) != size) {
+        std::ofstream out(file.c_str(), std::ios::binary | std::ios::trunc);
+        std::string block(1024 * 1024, 'k');
+        for(std::size_t i = 0; i < size / block.size(); ++i) {
+            out << block;
+        }
+    }
+
+    std::size_t seen = 0;
+    std::cout << "File of " << size / (1024 * 1024) << "MiB" << std::endl;
+
+    std::cout << "  ifstream:                    " << time_ms([&]() {
+        std::ifstream in(file.c_str(), std::ios::binary);
+        std::string contents((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        seen = contents.size();
+    }) << "ms" << std::endl;
+
+    for(uint32_t threads: {1, 4, 8}) {
+        for(std::size_t chunk: {1024 * 1024, 8 * 1024 * 1024}) {
+            kfs::ReadOptions options;
+            options.threads = threads;
+            options.chunk_size = chunk;
+
+            std::string buffer;
+            std::cout << "  read_file_parallel (" << threads << "t, " << chunk / (1024 * 1024) << "MiB):"
+                      << std::string(5 - std::to_string(chunk / (1024 * 1024)).size(), ' ') << time_ms([&]() {
+                seen = kfs::read_file_parallel(file, buffer, options).bytes;
+            }) << "ms" << std::endl;
+        }
+    }
+
+    return (seen == size) ? 0 : 1;
+}
@@ -6,7 +6,19 @@
 #include <string>
 #include <iostream>
 #include <cassert>
+#include <cstring>
+#include <climits>
 #include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <exception>
+#include <functional>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <map>
+#include <tuple>
 
 #include "kfs.h"
 
@@ -31,7 +43,28 @@
     #include <utime.h>
     #include <unistd.h>
     #include <sys/types.h>
+    #include <sys/mman.h>
+    #include <sys/uio.h>
+    #include <sys/statvfs.h>
+    #include <fcntl.h>
+    #include <fnmatch.h>
     #include <dirent.h>
+
+    #include <poll.h>
+
+    #ifdef __linux__
+        #include <sys/syscall.h>
+        #include <sys/inotify.h>
+        #include <linux/falloc.h>
+        #include <linux/fs.h>
+        #include <sys/ioctl.h>
+    #endif
+
+    #define KFS_POSIX 1
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
 #endif
 
 #ifdef __APPLE__
@@ -59,28 +92,7 @@ static bool starts_with(const Path& p, const std::string& thing) {
     return p.find(thing) == 0;
 }
 
-static std::string slice(const std::string& input, uint32_t start, void* end=nullptr) {
-    (void) (end);
-    return std::string(input.begin() + start, input.end());
-}
-
-static std::string slice(const std::string &input, void* start, uint32_t end) {
-    (void) (start);
-    return std::string(input.begin(), input.begin() + end);
-}
-
-static std::string multiply(const std::string& input, const uint32_t count) {
-    std::string result;
-    for(uint32_t i = 0; i < count; ++i) result += input;
-    return result;
-}
-
-static std::string rstrip(const std::string& input, const std::string& what=" \n\r\t") {
-    std::string result = input;
-    result.erase(result.find_last_not_of(what) + 1);
-    return result;
-}
-
+#ifdef __WIN32__
 static std::string str_join(const std::string& joiner, const std::vector<std::string>& parts) {
     std::string result;
 
@@ -94,38 +106,270 @@ static std::string str_join(const std::string& joiner, const std::vector<std::st
 
     return result;
 }
+#endif
 
-static std::vector<std::string> str_split(const std::string& input, const std::string& on) {
+static std::vector<std::string> str_split(const std::string& input, char on) {
     std::vector<std::string> elems;
-    std::stringstream ss(input);
-    std::string item;
-
-    assert(on.length() == 1);
 
-    while (std::getline(ss, item, on[0])) {
-        if(item.empty()) continue;
+    std::string::size_type start = 0;
+    while(start <= input.size()) {
+        auto end = input.find(on, start);
+        if(end == std::string::npos) {
+            end = input.size();
+        }
 
-        elems.push_back(item);
+        if(end != start) {
+            elems.push_back(input.substr(start, end - start));
+        }
+        start = end + 1;
     }
+
     return elems;
 }
 
-static std::vector<std::string> common_prefix(const std::vector<std::string>& lhs, const std::vector<std::string>& rhs) {
-    if(lhs.empty() && rhs.empty()) {
-        return std::vector<std::string>();
+/* Calls func(offset, length) for each non-empty component of a path */
+template<typename Func>
+static void for_each_component(std::string_view input, char sep, Func func) {
+    std::string_view::size_type start = 0;
+    while(start < input.size()) {
+        auto end = input.find(sep, start);
+        if(end == std::string_view::npos) {
+            end = input.size();
+        }
+
+        if(end != start) {
+            func(start, end - start);
+        }
+        start = end + 1;
+    }
+}
+
+/* Joins a name onto a path relative to some root, which may be empty */
+static Path join_rel(const Path& base, const Path& name) {
+    return (base.empty()) ? name : path::join(base, name);
+}
+
+static uint32_t thread_count(uint32_t requested) {
+    if(requested) {
+        return requested;
+    }
+
+    uint32_t cores = std::thread::hardware_concurrency();
+    return (cores) ? cores : 1;
+}
+
+IoBudget::IoBudget(uint64_t ops_per_second, uint64_t bytes_per_second):
+    ops_rate_(ops_per_second),
+    bytes_rate_(bytes_per_second),
+    ops_tokens_(0),
+    bytes_tokens_(0),
+    last_(std::chrono::steady_clock::now()) {
+
+}
+
+void IoBudget::set_ops_per_second(uint64_t rate) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ops_rate_ = rate;
+}
+
+void IoBudget::set_bytes_per_second(uint64_t rate) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    bytes_rate_ = rate;
+}
+
+/* Tokens accrue at the configured rate, up to a tenth of a second's worth so
+ * an idle budget doesn't allow a burst afterwards */
+void IoBudget::refill(std::chrono::steady_clock::time_point now) {
+    double elapsed = std::chrono::duration<double>(now - last_).count();
+    last_ = now;
+
+    ops_tokens_ = std::min(ops_tokens_ + elapsed * ops_rate_, ops_rate_ / 10.0);
+    bytes_tokens_ = std::min(bytes_tokens_ + elapsed * bytes_rate_, bytes_rate_ / 10.0);
+}
+
+void IoBudget::acquire(uint64_t ops, uint64_t bytes) {
+    ops_done_ += ops;
+    bytes_done_ += bytes;
+
+    double wait = 0;
+    auto now = std::chrono::steady_clock::now();
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        refill(now);
+
+        /* Take the tokens now, even if that leaves us in debt, and wait for
+         * the debt to be paid off. Later callers queue up behind us */
+        if(ops_rate_) {
+            ops_tokens_ -= ops;
+            if(ops_tokens_ < 0) {
+                wait = std::max(wait, -ops_tokens_ / ops_rate_);
+            }
+        }
+
+        if(bytes_rate_) {
+            bytes_tokens_ -= bytes;
+            if(bytes_tokens_ < 0) {
+                wait = std::max(wait, -bytes_tokens_ / bytes_rate_);
+            }
+        }
+    }
+
+    if(wait > 0) {
+        std::this_thread::sleep_until(now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(wait)
+        ));
+    }
+}
+
+static void charge(IoBudget* budget, uint64_t ops, uint64_t bytes=0) {
+    if(budget) {
+        budget->acquire(ops, bytes);
+    }
+}
+
+#ifdef __linux__
+static const int IOPRIO_WHO_PROCESS = 1;
+static const int IOPRIO_CLASS_IDLE = 3;
+static const int IOPRIO_CLASS_SHIFT = 13;
+#endif
+
+/* Drops the calling thread to the idle I/O class while in scope, if the
+ * budget asks for it */
+class ScopedIoPriority {
+public:
+    explicit ScopedIoPriority(const IoBudget* budget) {
+#ifdef __linux__
+        if(budget && budget->idle_priority()) {
+            previous_ = ::syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+            if(previous_ >= 0) {
+                ::syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+            }
+        }
+#else
+        (void) (budget);
+#endif
+    }
+
+    ~ScopedIoPriority() {
+#ifdef __linux__
+        if(previous_ >= 0) {
+            ::syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, previous_);
+        }
+#endif
+    }
+
+    ScopedIoPriority(const ScopedIoPriority&) = delete;
+    ScopedIoPriority& operator=(const ScopedIoPriority&) = delete;
+
+private:
+    long previous_ = -1;
+};
+
+/* Calls func(i) for every i in [0, count) spread across a number of threads.
+ * The first exception thrown by any call stops the remaining work and is
+ * rethrown on the calling thread */
+static void parallel_for(std::size_t count, uint32_t threads, const std::function<void (std::size_t)>& func,
+                         IoBudget* budget=nullptr) {
+    std::size_t workers = std::min<std::size_t>(thread_count(threads), count);
+    ScopedIoPriority priority(budget);
+
+    if(workers <= 1) {
+        for(std::size_t i = 0; i < count; ++i) {
+            func(i);
+        }
+        return;
+    }
+
+    std::atomic<std::size_t> next(0);
+    std::exception_ptr error;
+    std::mutex error_mutex;
+
+    auto run = [&]() {
+        ScopedIoPriority priority(budget);
+
+        for(;;) {
+            std::size_t i = next++;
+            if(i >= count) {
+                return;
+            }
+
+            try {
+                func(i);
+            } catch(...) {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if(!error) {
+                    error = std::current_exception();
+                }
+                next = count;
+                return;
+            }
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for(std::size_t i = 1; i < workers; ++i) {
+        pool.push_back(std::thread(run));
+    }
+
+    run();
+
+    for(auto& thread: pool) {
+        thread.join();
+    }
+
+    if(error) {
+        std::rethrow_exception(error);
     }
+}
 
-    auto shorter = (lhs.size() < rhs.size()) ? lhs: rhs;
-    auto longer = (lhs.size() > rhs.size()) ? lhs: rhs;
+#ifdef KFS_POSIX
+/* Closes the wrapped file descriptor when it goes out of scope */
+class ScopedFD {
+public:
+    explicit ScopedFD(int fd=-1):
+        fd_(fd) {}
 
-    for(std::vector<std::string>::size_type i = 0; i < shorter.size(); ++i) {
-        if(shorter[i] != longer[i]) {
-            return std::vector<std::string>(shorter.begin(), shorter.begin() + i);
+    ~ScopedFD() {
+        if(fd_ >= 0) {
+            ::close(fd_);
         }
     }
 
-    return shorter;
+    ScopedFD(const ScopedFD&) = delete;
+    ScopedFD& operator=(const ScopedFD&) = delete;
+
+    int get() const { return fd_; }
+
+private:
+    int fd_;
+};
+
+/* Reads the whole of a file relative to an open directory. Returns false if
+ * it can't be opened */
+static bool read_file_at(int dir_fd, const char* name, std::string& out) {
+    ScopedFD fd(::openat(dir_fd, name, O_RDONLY | O_CLOEXEC));
+    if(fd.get() < 0) {
+        return false;
+    }
+
+    out.clear();
+
+    char buffer[16 * 1024];
+    for(;;) {
+        ssize_t n = ::read(fd.get(), buffer, sizeof(buffer));
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return false;
+        } else if(n == 0) {
+            return true;
+        }
+
+        out.append(buffer, n);
+    }
 }
+#endif
 
 // =================== END UTILITY FUNCTIONS ======================================================
 // ================================================================================================
@@ -145,8 +389,29 @@ uint32_t psp_time_to_epoch(ScePspDateTime pt) {
 }
 #endif
 
+#ifdef KFS_POSIX
+static void fill_stat(const struct ::stat& result, Stat& ret) {
+    ret.atime = result.st_atime;
+    ret.ctime = result.st_ctime;
+    ret.dev = result.st_dev;
+    ret.gid = result.st_gid;
+    ret.ino = result.st_ino;
+    ret.mode = result.st_mode;
+    ret.mtime = result.st_mtime;
+    ret.nlink = result.st_nlink;
+    ret.rdev = result.st_rdev;
+    ret.size = result.st_size;
+    ret.uid = result.st_uid;
+#ifdef __APPLE__
+    ret.mtime_ns = uint64_t(result.st_mtimespec.tv_sec) * 1000000000ull + result.st_mtimespec.tv_nsec;
+#else
+    ret.mtime_ns = uint64_t(result.st_mtim.tv_sec) * 1000000000ull + result.st_mtim.tv_nsec;
+#endif
+}
+#endif
+
 std::pair<Stat, bool> lstat(const Path& path) {
-    Stat ret;
+    Stat ret = Stat();
 
 #ifdef __WIN32__
     struct _stat result;
@@ -165,6 +430,7 @@ std::pair<Stat, bool> lstat(const Path& path) {
     ret.rdev = result.st_rdev;
     ret.size = result.st_size;
     ret.uid = result.st_uid;
+    ret.mtime_ns = uint64_t(ret.mtime) * 1000000000ull;
 #elif defined(__PSP__)
     SceIoStat s;
     if(sceIoGetstat(path.c_str(), &s) < 0) {
@@ -175,6 +441,7 @@ std::pair<Stat, bool> lstat(const Path& path) {
     ret.ctime = psp_time_to_epoch(s.st_ctime);
     ret.mtime = psp_time_to_epoch(s.st_mtime);
     ret.size = s.st_size;
+    ret.mtime_ns = uint64_t(ret.mtime) * 1000000000ull;
 
     // FIXME: Other things!
 #else
@@ -184,21 +451,63 @@ std::pair<Stat, bool> lstat(const Path& path) {
         return std::make_pair(ret, false);
     }
 
-    ret.atime = result.st_atime;
-    ret.ctime = result.st_ctime;
-    ret.dev = result.st_dev;
-    ret.gid = result.st_gid;
-    ret.ino = result.st_ino;
-    ret.mode = result.st_mode;
-    ret.mtime = result.st_mtime;
-    ret.nlink = result.st_nlink;
-    ret.rdev = result.st_rdev;
-    ret.size = result.st_size;
-    ret.uid = result.st_uid;
+    fill_stat(result, ret);
 #endif
     return std::make_pair(ret, true);
 }
 
+/* Like lstat(), but doesn't follow a symlink at the end of the path. Used
+ * by the tree walkers so that links are never descended into */
+static bool lstat_nofollow(const Path& path, Stat& out) {
+#ifdef KFS_POSIX
+    struct ::stat result;
+    if(::lstat(path.c_str(), &result) == -1) {
+        return false;
+    }
+
+    fill_stat(result, out);
+    return true;
+#else
+    auto st = lstat(path);
+    out = st.first;
+    return st.second;
+#endif
+}
+
+/* Classifies an entry as 'd'irectory, 'f'ile, 'l'ink or 'o'ther */
+static char entry_kind(const Stat& st) {
+    if(S_ISDIR(st.mode)) {
+        return 'd';
+    } else if(S_ISREG(st.mode)) {
+        return 'f';
+#ifdef S_ISLNK
+    } else if(S_ISLNK(st.mode)) {
+        return 'l';
+#endif
+    }
+
+    return 'o';
+}
+
+static Path read_link(const Path& path) {
+#ifdef KFS_POSIX
+    std::vector<char> buffer(256);
+    for(;;) {
+        ssize_t len = ::readlink(path.c_str(), &buffer[0], buffer.size());
+        if(len < 0) {
+            throw IOError(errno);
+        } else if(std::size_t(len) < buffer.size()) {
+            return Path(&buffer[0], len);
+        }
+
+        buffer.resize(buffer.size() * 2);
+    }
+#else
+    (void) (path);
+    throw std::logic_error("Not implemented");
+#endif
+}
+
 void touch(const Path& path) {
 #if defined(_arch_dreamcast) || defined(__PSP__)
     (void) (path);
@@ -225,27 +534,34 @@ void touch(const Path& path) {
 
     CloseHandle(handle);
 #else
-    if(!kfs::path::exists(path)) {
-        make_dirs(kfs::path::dir_name(path));
-
-        std::ofstream file(path.c_str());
-        file.close();
+    /* Bump the mtime of an existing file, leaving the atime alone */
+    struct timespec times[2];
+    times[0].tv_nsec = UTIME_OMIT;
+    times[1].tv_nsec = UTIME_NOW;
+    if(::utimensat(AT_FDCWD, path.c_str(), times, 0) == 0 || errno != ENOENT) {
+        return;
     }
 
-    struct utimbuf new_times;
-    auto st = kfs::lstat(path);
-    if(st.second) {
-        new_times.actime = st.first.atime;
-    } else {
-        std::cerr << "Unable to read atime" << std::endl;
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0666);
+    if(fd < 0 && errno == ENOENT) {
+        make_dirs(kfs::path::dir_name(path));
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0666);
     }
 
-    new_times.modtime = time(NULL);
-    utime(path.c_str(), &new_times);
+    if(fd < 0) {
+        throw IOError(errno);
+    }
+    ::close(fd);
 #endif
 }
 
 void make_dir(const Path& path, Mode mode) {
+#ifdef KFS_POSIX
+    /* mkdir fails with EEXIST itself */
+    if(mkdir(path.c_str(), mode) != 0) {
+        throw kfs::IOError(errno);
+    }
+#else
     if(kfs::path::exists(path)) {
         throw kfs::IOError(EEXIST);
     } else {
@@ -265,6 +581,7 @@ void make_dir(const Path& path, Mode mode) {
         }
 #endif
     }
+#endif
 }
 
 void make_link(const Path& source, const Path& dest) {
@@ -322,6 +639,13 @@ void make_dirs(const Path &path, Mode mode) {
 }
 
 void remove(const Path& path) {
+#ifdef KFS_POSIX
+    /* Straight to unlink, only working out why if it fails. Linux gives
+     * EISDIR for a directory, POSIX allows EPERM */
+    if(::unlink(path.c_str()) != 0 && (errno == EISDIR || errno == EPERM) && kfs::path::is_dir(path)) {
+        throw IOError("Tried to remove a folder, use remove_dir instead");
+    }
+#else
     if(kfs::path::exists(path)) {
         if(kfs::path::is_dir(path)) {
             throw IOError("Tried to remove a folder, use remove_dir instead");
@@ -329,6 +653,7 @@ void remove(const Path& path) {
             ::remove(path.c_str());
         }
     }
+#endif
 }
 
 void remove_dir(const Path& path) {
@@ -351,17 +676,21 @@ void remove_dir(const Path& path) {
     }
 }
 
-void remove_dirs(const Path& path) {
+void remove_dirs(const Path& path, IoBudget* budget) {
     if(!kfs::path::exists(path)) {
         throw IOError("Tried to remove a non-existent path");
     }
 
+    ScopedIoPriority priority(budget);
+
     for(Path f: kfs::path::list_dir(path)) {
         Path full = kfs::path::join(path, f);
         if(kfs::path::is_dir(full)) {
-            remove_dirs(full);
+            remove_dirs(full, budget);
+            charge(budget, 1);
             remove_dir(full);
         } else {
+            charge(budget, 1);
             remove(full);
         }
     }
@@ -379,101 +708,479 @@ void rename(const Path& old, const Path& new_path) {
 #endif
 }
 
-std::string temp_dir() {
-#ifdef WIN32
-    TCHAR temp_path_buffer[MAX_PATH];
-    GetTempPath(MAX_PATH, temp_path_buffer);
-    return std::string(temp_path_buffer);
+#if defined(__linux__) && !defined(RENAME_EXCHANGE)
+    #define RENAME_NOREPLACE (1 << 0)
+    #define RENAME_EXCHANGE (1 << 1)
+#endif
+
+/* __GLIBC_PREREQ is only there to expand on glibc, so it can't share an #if
+ * with the check for it */
+#ifdef __GLIBC__
+#if __GLIBC_PREREQ(2, 28)
+    #define KFS_HAVE_RENAMEAT2
+#endif
+#endif
+
+#ifdef __linux__
+static int rename_flags(const Path& old, const Path& new_path, unsigned int flags) {
+#ifdef KFS_HAVE_RENAMEAT2
+    return ::renameat2(AT_FDCWD, old.c_str(), AT_FDCWD, new_path.c_str(), flags);
 #else
-    return "/tmp";
+    return ::syscall(SYS_renameat2, AT_FDCWD, old.c_str(), AT_FDCWD, new_path.c_str(), flags);
 #endif
 }
+#endif
 
-Path exe_path() {
-#ifdef __WIN32__
-    TCHAR szFileName[MAX_PATH + 1];
-    GetModuleFileName(NULL, szFileName, MAX_PATH + 1);
-    return szFileName;
+void exchange(const Path& a, const Path& b) {
+#ifdef __linux__
+    if(rename_flags(a, b, RENAME_EXCHANGE) != 0) {
+        throw IOError(errno);
+    }
 #elif defined(__APPLE__)
-    char buff[1024];
-    uint32_t size = sizeof(buff);
-
-    if(_NSGetExecutablePath(buff, &size) == 0) {
-        return Path(buff);
+    if(::renamex_np(a.c_str(), b.c_str(), RENAME_SWAP) != 0) {
+        throw IOError(errno);
     }
-
-    throw std::runtime_error("Unable to work out the program filename");
-#elif defined(_arch_dreamcast)
-    /* The Dreamcast binary is always called 1ST_READ.BIN, and it makes sense to
-     * say that it's in the root of the tree (it is essentially)
-     */
-    return "/1ST_READ.BIN";
-#elif defined(__PSP__)
-    /* FIXME: This isn't ideal, could possibly result in the wrong thing */
-    return std::string(get_cwd()) + "/EBOOT.PBP";
 #else
-    char buff[1024];
-    ssize_t len = ::readlink("/proc/self/exe", buff, sizeof(buff)-1);
-    if(len != -1) {
-        buff[len] = '\0';
-        return Path(buff);
-    }
-
-    throw std::runtime_error("Unable to work out the program filename");
+    (void) (a);
+    (void) (b);
+    throw std::logic_error("Not implemented");
 #endif
 }
 
-Path exe_dirname() {
-    Path path = exe_path();
-    return path::dir_name(path);
-}
+void rename_noreplace(const Path& old, const Path& new_path) {
+#if defined(__linux__) || defined(__APPLE__)
+#ifdef __linux__
+    int ret = rename_flags(old, new_path, RENAME_NOREPLACE);
+#else
+    int ret = ::renamex_np(old.c_str(), new_path.c_str(), RENAME_EXCL);
+#endif
+    if(ret == 0) {
+        return;
+    } else if(errno != EINVAL && errno != ENOSYS && errno != ENOTSUP) {
+        throw IOError(errno);
+    }
 
-Path get_cwd(){
-    char buf[FILENAME_MAX];
-    char* succ = getcwd(buf, FILENAME_MAX);
+    /* The filesystem doesn't support it, fall back to checking first */
+#endif
 
-    if(succ) {
-        return Path(succ);
+    Stat st;
+    if(lstat_nofollow(new_path, st)) {
+        throw IOError(EEXIST);
     }
 
-    throw std::runtime_error("Unable to get the current working directory");
+    rename(old, new_path);
 }
 
+static std::atomic<uint32_t> temp_counter(0);
 
-namespace path {
+#ifdef KFS_POSIX
+static const std::size_t COPY_BUFFER_SIZE = 1024 * 1024;
 
-Path join(const Path &p1, const Path &p2) {
-    return p1 + SEP + p2;
+/* A name alongside path to write to before renaming over path, so that
+ * readers only ever see the old or the complete new file */
+static Path temp_name_for(const Path& path) {
+    auto parts = path::split(path);
+    Path name = "." + parts.second + ".kfs-" + std::to_string(::getpid()) + "-" + std::to_string(temp_counter++);
+    return (parts.first.empty()) ? name : path::join(parts.first, name);
 }
 
-Path join(const std::vector<Path>& parts) {
-    Path ret;
-    std::size_t i = 0;
-    for(auto& part: parts) {
-        ret += part;
-        ++i;
-        if(i != parts.size()) {
-            ret += SEP;
-        }
+/* fsyncs a file or directory by path, e.g. a temporary file before it's
+ * renamed into place, or the directory it was renamed in */
+static void sync_path(const Path& path) {
+    ScopedFD fd(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    if(fd.get() < 0 || ::fsync(fd.get()) != 0) {
+        throw IOError(errno);
     }
+}
 
-    return ret;
+static void sync_parent(const Path& path) {
+    Path parent = path::dir_name(path);
+    sync_path(parent.empty() ? Path(".") : parent);
 }
 
-Path abs_path(const Path& p) {
-    Path path = p;
+/* Calls func(offset, length) for each data extent of fd from offset
+ * onwards. Returns false if the filesystem can't tell where the holes are */
+template<typename Func>
+static bool for_each_extent(int fd, uint64_t offset, uint64_t size, Func func) {
+#ifdef SEEK_DATA
+    while(offset < size) {
+        off_t data = ::lseek(fd, offset, SEEK_DATA);
+        if(data < 0) {
+            if(errno == ENXIO) {
+                /* Nothing but hole from here to the end */
+                return true;
+            } else if(errno == EINVAL || errno == EOPNOTSUPP) {
+                return false;
+            }
+            throw IOError(errno);
+        }
 
-    if(!is_absolute(p)) {
-        Path cwd = get_cwd();
-        path = join(cwd, p);
-    }
+        off_t hole = ::lseek(fd, data, SEEK_HOLE);
+        if(hole < 0) {
+            throw IOError(errno);
+        }
 
-    return norm_path(path);
+        func(uint64_t(data), uint64_t(hole - data));
+        offset = hole;
+    }
+    return true;
+#else
+    (void) (fd);
+    (void) (offset);
+    (void) (size);
+    (void) (func);
+    return false;
+#endif
 }
 
-Path norm_case(const Path& path) {
-#ifdef __WIN32__
-    assert(0);
+static void pwrite_full(int fd, const char* data, std::size_t length, off_t offset) {
+    while(length > 0) {
+        ssize_t written = ::pwrite(fd, data, length, offset);
+        if(written < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            throw IOError(errno);
+        }
+        data += written;
+        length -= written;
+        offset += written;
+    }
+}
+
+/* Copies only the data extents of a sparse file, then sets the size so any
+ * hole at the end is kept. Returns false if holes can't be found */
+static bool copy_sparse(int in, int out, uint64_t size, IoBudget* budget) {
+    std::vector<char> buffer;
+
+    bool supported = for_each_extent(in, 0, size, [&](uint64_t offset, uint64_t length) {
+        buffer.resize(COPY_BUFFER_SIZE);
+
+        while(length > 0) {
+            std::size_t wanted = std::min<uint64_t>(length, buffer.size());
+            ssize_t n = ::pread(in, &buffer[0], wanted, offset);
+            if(n < 0) {
+                if(errno == EINTR) {
+                    continue;
+                }
+                throw IOError(errno);
+            } else if(n == 0) {
+                return;
+            }
+
+            charge(budget, 1, n);
+            pwrite_full(out, &buffer[0], n, offset);
+            offset += n;
+            length -= n;
+        }
+    });
+
+    if(supported && ::ftruncate(out, size) != 0) {
+        throw IOError(errno);
+    }
+
+    return supported;
+}
+
+static const std::size_t COPY_RANGE_SIZE = 8 * 1024 * 1024;
+
+#ifdef __GLIBC__
+#if __GLIBC_PREREQ(2, 27)
+    #define KFS_HAVE_COPY_FILE_RANGE
+#endif
+#endif
+
+/* Has the kernel copy from in to out with copy_file_range, so the data
+ * never passes through userspace and filesystems that can share extents
+ * do. Returns false if it isn't supported between the two files, in which
+ * case nothing was copied */
+static bool copy_range(int in, int out, IoBudget* budget) {
+#ifdef __linux__
+    bool copied = false;
+
+    for(;;) {
+#ifdef KFS_HAVE_COPY_FILE_RANGE
+        ssize_t n = ::copy_file_range(in, nullptr, out, nullptr, COPY_RANGE_SIZE, 0);
+#else
+        ssize_t n = ::syscall(SYS_copy_file_range, in, nullptr, out, nullptr, COPY_RANGE_SIZE, 0);
+#endif
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+
+            if(!copied && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+                return false;
+            }
+            throw IOError(errno);
+        } else if(n == 0) {
+            return true;
+        }
+
+        copied = true;
+        charge(budget, 1, n);
+    }
+#else
+    (void) (in);
+    (void) (out);
+    (void) (budget);
+    return false;
+#endif
+}
+
+static void copy_fd(int in, int out, IoBudget* budget) {
+    struct ::stat st;
+    if(::fstat(in, &st) == 0 && S_ISREG(st.st_mode)) {
+        /* Fewer blocks than the size needs means there are holes to skip */
+        if(uint64_t(st.st_blocks) * 512 < uint64_t(st.st_size)) {
+            if(copy_sparse(in, out, st.st_size, budget)) {
+                return;
+            }
+
+            /* Seeking for holes moved the offset */
+            ::lseek(in, 0, SEEK_SET);
+        } else if(st.st_size > 0 && copy_range(in, out, budget)) {
+            /* Files claiming to be empty (e.g. in /proc) are read instead */
+            return;
+        }
+    }
+
+    std::vector<char> buffer(COPY_BUFFER_SIZE);
+
+    for(;;) {
+        ssize_t n = ::read(in, &buffer[0], buffer.size());
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            throw IOError(errno);
+        } else if(n == 0) {
+            return;
+        }
+
+        charge(budget, 1, n);
+
+        const char* p = &buffer[0];
+        while(n > 0) {
+            ssize_t written = ::write(out, p, n);
+            if(written < 0) {
+                if(errno == EINTR) {
+                    continue;
+                }
+                throw IOError(errno);
+            }
+            p += written;
+            n -= written;
+        }
+    }
+}
+
+static void copy_link(const Path& source, const Path& dest) {
+    Path target = read_link(source);
+    Path temp = temp_name_for(dest);
+
+    if(::symlink(target.c_str(), temp.c_str()) != 0) {
+        throw IOError(errno);
+    }
+
+    if(::rename(temp.c_str(), dest.c_str()) != 0) {
+        int err = errno;
+        ::unlink(temp.c_str());
+        throw IOError(err);
+    }
+}
+#endif
+
+/* With sync set, the copy is fsynced before it's renamed into place. The
+ * rename itself is only durable once the directory has been synced too */
+static void copy_file(const Path& source, const Path& dest, IoBudget* budget, bool sync) {
+#ifdef KFS_POSIX
+    ScopedIoPriority priority(budget);
+
+    ScopedFD in(::open(source.c_str(), O_RDONLY | O_CLOEXEC));
+    if(in.get() < 0) {
+        throw IOError(errno);
+    }
+
+    struct ::stat st;
+    if(::fstat(in.get(), &st) != 0) {
+        throw IOError(errno);
+    }
+
+    if(S_ISDIR(st.st_mode)) {
+        throw IOError("Tried to copy a folder");
+    }
+
+    Path temp = temp_name_for(dest);
+
+    try {
+        ScopedFD out(::open(temp.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600));
+        if(out.get() < 0) {
+            throw IOError(errno);
+        }
+
+        copy_fd(in.get(), out.get(), budget);
+
+#ifdef __APPLE__
+        struct timespec times[2] = {st.st_atimespec, st.st_mtimespec};
+#else
+        struct timespec times[2] = {st.st_atim, st.st_mtim};
+#endif
+        if(::fchmod(out.get(), st.st_mode & 07777) != 0 || ::futimens(out.get(), times) != 0) {
+            throw IOError(errno);
+        }
+
+        if(sync && ::fsync(out.get()) != 0) {
+            throw IOError(errno);
+        }
+    } catch(...) {
+        ::unlink(temp.c_str());
+        throw;
+    }
+
+    if(::rename(temp.c_str(), dest.c_str()) != 0) {
+        int err = errno;
+        ::unlink(temp.c_str());
+        throw IOError(err);
+    }
+#else
+    (void) (source);
+    (void) (dest);
+    (void) (budget);
+    (void) (sync);
+    throw std::logic_error("Not implemented");
+#endif
+}
+
+void copy_file(const Path& source, const Path& dest, IoBudget* budget) {
+    copy_file(source, dest, budget, false);
+}
+
+std::string temp_dir() {
+#ifdef WIN32
+    TCHAR temp_path_buffer[MAX_PATH];
+    GetTempPath(MAX_PATH, temp_path_buffer);
+    return std::string(temp_path_buffer);
+#else
+    return "/tmp";
+#endif
+}
+
+Path exe_path() {
+#ifdef __WIN32__
+    TCHAR szFileName[MAX_PATH + 1];
+    GetModuleFileName(NULL, szFileName, MAX_PATH + 1);
+    return szFileName;
+#elif defined(__APPLE__)
+    char buff[1024];
+    uint32_t size = sizeof(buff);
+
+    if(_NSGetExecutablePath(buff, &size) == 0) {
+        return Path(buff);
+    }
+
+    throw std::runtime_error("Unable to work out the program filename");
+#elif defined(_arch_dreamcast)
+    /* The Dreamcast binary is always called 1ST_READ.BIN, and it makes sense to
+     * say that it's in the root of the tree (it is essentially)
+     */
+    return "/1ST_READ.BIN";
+#elif defined(__PSP__)
+    /* FIXME: This isn't ideal, could possibly result in the wrong thing */
+    return std::string(get_cwd()) + "/EBOOT.PBP";
+#else
+    char buff[1024];
+    ssize_t len = ::readlink("/proc/self/exe", buff, sizeof(buff)-1);
+    if(len != -1) {
+        buff[len] = '\0';
+        return Path(buff);
+    }
+
+    throw std::runtime_error("Unable to work out the program filename");
+#endif
+}
+
+Path exe_dirname() {
+    Path path = exe_path();
+    return path::dir_name(path);
+}
+
+/* The working directory only changes through chdir, so we cache it and rely
+ * on change_dir() to tell us when it moves */
+static std::mutex cwd_mutex;
+static Path cwd_cache;
+
+Path get_cwd(){
+    std::lock_guard<std::mutex> lock(cwd_mutex);
+
+    if(cwd_cache.empty()) {
+        char buf[FILENAME_MAX];
+        char* succ = getcwd(buf, FILENAME_MAX);
+
+        if(!succ) {
+            throw std::runtime_error("Unable to get the current working directory");
+        }
+
+        cwd_cache = succ;
+    }
+
+    return cwd_cache;
+}
+
+void change_dir(const Path& path) {
+    std::lock_guard<std::mutex> lock(cwd_mutex);
+
+#ifdef _arch_dreamcast
+    if(fs_chdir(path.c_str()) != 0) {
+        throw IOError("Unable to change directory");
+    }
+#else
+    if(::chdir(path.c_str()) != 0) {
+        throw IOError(errno);
+    }
+#endif
+
+    cwd_cache.clear();
+}
+
+
+namespace path {
+
+Path join(const Path &p1, const Path &p2) {
+    Path result;
+    result.reserve(p1.size() + 1 + p2.size());
+    result.append(p1).append(1, SEP).append(p2);
+    return result;
+}
+
+Path join(const std::vector<Path>& parts) {
+    Path ret;
+    std::size_t i = 0;
+    for(auto& part: parts) {
+        ret += part;
+        ++i;
+        if(i != parts.size()) {
+            ret += SEP;
+        }
+    }
+
+    return ret;
+}
+
+Path abs_path(const Path& p) {
+    Path path = p;
+
+    if(!is_absolute(p)) {
+        Path cwd = get_cwd();
+        path = join(cwd, p);
+    }
+
+    return norm_path(path);
+}
+
+Path norm_case(const Path& path) {
+#ifdef __WIN32__
+    assert(0);
 #endif
     return path;
 }
@@ -575,7 +1282,7 @@ static Path nt_norm_path(Path path) {
             path = path.substr(1, std::string::npos);
         }
     }
-    auto comps = str_split(path, "\\");
+    auto comps = str_split(path, '\\');
 
     std::vector<Path> final;
 
@@ -605,68 +1312,19 @@ static Path nt_norm_path(Path path) {
 #endif
 
 
-#ifndef __WIN32__
-static Path posix_norm_path(const Path& path) {
-    Path slash = Path(SEP);
-    Path dot = ".";
-
-    if(path.empty()) {
-        return dot;
-    }
-
-    int32_t initial_slashes = starts_with(path, SEP) ? 1: 0;
-    //POSIX treats 3 or more slashes as a single one
-    if(initial_slashes && starts_with(path, SEP + SEP) && !starts_with(path, SEP+SEP+SEP)) {
-        initial_slashes = 2;
-    }
-
-    std::vector<Path> comps = str_split(path, slash);
-    std::vector<Path> new_comps;
-
-    for(Path comp: comps) {
-        if(comp.empty() || comp == dot) {
-            continue;
-        }
-
-        if(comp != ".." ||
-            (initial_slashes == 0 && new_comps.empty()) ||
-            (!new_comps.empty() && new_comps.back() == "..")
-            ) {
-            new_comps.push_back(comp);
-        } else if(!new_comps.empty()) {
-            new_comps.pop_back();
-        }
-    }
-
-    comps = new_comps;
-    Path final_path = str_join(slash, comps);
-    if(initial_slashes) {
-        final_path = multiply(slash, initial_slashes) + final_path;
-    }
-
-    return final_path.empty() ? dot : final_path;
-}
-#endif
-
 Path norm_path(const Path& path) {
 #ifdef __WIN32__
     return nt_norm_path(path);
 #else
-    return posix_norm_path(path);
+    Path result;
+    norm_path_into(path, result);
+    return result;
 #endif
 }
 
 std::pair<Path, Path> split(const Path& path) {
-    Path::size_type i = path.rfind(SEP) + 1;
-
-    Path head = slice(path, nullptr, i);
-    Path tail = slice(path, i, nullptr);
-
-    if(!head.empty() && head != multiply(SEP, head.length())) {
-        head = rstrip(head, SEP);
-    }
-
-    return std::make_pair(head, tail);
+    auto parts = split_view(path);
+    return std::make_pair(Path(parts.first), Path(parts.second));
 }
 
 bool exists(const Path &path) {
@@ -674,22 +1332,7 @@ bool exists(const Path &path) {
 }
 
 Path dir_name(const Path& path) {
-    Path::size_type i = path.rfind(SEP) + 1;
-    Path head = slice(path, nullptr, i);
-    if(!head.empty() && head != multiply(SEP, head.length())) {
-        head = rstrip(head, SEP);
-    }
-    return head;
-}
-
-bool is_absolute(const Path& path) {
-    #ifdef _WIN32
-        return (path.c_str()[1] == ':');
-    #elif defined(__PSP__)
-        return starts_with(path, "umd0:") || starts_with(path, "ms0:") || starts_with(path, "disc0:") || starts_with(path, "host0:");
-    #else
-        return starts_with(path, "/");
-    #endif
+    return Path(split_view(path).first);
 }
 
 bool is_dir(const Path& path) {
@@ -737,49 +1380,143 @@ Path real_path(const Path& path) {
 #endif
 }
 
-Path rel_path(const Path& path, const Path& start) {
-    if(path.empty()) {
-        return "";
-    }
-
-    auto start_list = str_split(path::abs_path(start), SEP);
-    auto path_list = str_split(path::abs_path(path), SEP);
+/* True if norm_path() would leave an absolute path untouched, which is the
+ * common case and lets us skip splitting and rejoining it */
+static bool is_normalized_absolute(const Path& path) {
+    const char sep = SEP;
 
-    int i = common_prefix(start_list, path_list).size();
+    if(path.size() < 2 || path[0] != sep || path[1] == sep || path.back() == sep) {
+        return path.size() == 1 && path[0] == SEP;
+    }
 
-    Path pardir = "..";
+    std::size_t start = 1;
+    while(start < path.size()) {
+        auto end = path.find(sep, start);
+        if(end == Path::npos) {
+            end = path.size();
+        }
 
-    std::vector<Path> result;
-    for(std::vector<std::string>::size_type j = 0; j < (start_list.size() - i); ++j) {
-        result.push_back(pardir);
-    }
+        auto length = end - start;
+        if(length == 0 ||
+            (length == 1 && path[start] == '.') ||
+            (length == 2 && path[start] == '.' && path[start + 1] == '.')) {
+            return false;
+        }
 
-    result.insert(result.end(), path_list.begin() + i, path_list.end());
-    if(result.empty()) {
-        return ".";
+        start = end + 1;
     }
 
-    return path::join(result);
+    return true;
 }
 
-#ifndef _arch_dreamcast
-#ifndef __WIN32__
-static Path get_env_var(const Path& name) {
-    char* env = getenv(name.c_str());
-    if(env) {
-        return Path(env);
-    }
+Relativizer::Relativizer(const Path& start):
+    start_(abs_path(start)) {
 
-    return Path();
+    for_each_component(start_, SEP, [this](std::size_t offset, std::size_t length) {
+        parts_.push_back(std::make_pair(offset, length));
+    });
 }
-#endif
-#endif
 
-Path expand_user(const Path& path) {
-#ifdef _arch_dreamcast
-    return path;
-#else
-    Path cp = path;
+Path Relativizer::relativize(const Path& path) const {
+    Path result;
+    relativize(path, result);
+    return result;
+}
+
+void Relativizer::relativize(const Path& path, Path& out) const {
+    out.clear();
+
+    if(path.empty()) {
+        return;
+    }
+
+    Path normalized;
+    const Path* target = &path;
+    if(!is_absolute(path) || !is_normalized_absolute(path)) {
+        normalized = abs_path(path);
+        target = &normalized;
+    }
+
+    const char sep = SEP;
+    const Path& p = *target;
+
+    /* Walk the components of the target alongside those of start */
+    std::size_t matched = 0;
+    std::size_t rest = 0;
+    std::size_t pos = 0;
+    while(pos < p.size()) {
+        while(pos < p.size() && p[pos] == sep) {
+            ++pos;
+        }
+
+        if(pos == p.size() || matched == parts_.size()) {
+            break;
+        }
+
+        auto end = p.find(sep, pos);
+        if(end == Path::npos) {
+            end = p.size();
+        }
+
+        const auto& part = parts_[matched];
+        if(end - pos != part.second || p.compare(pos, part.second, start_, part.first, part.second) != 0) {
+            break;
+        }
+
+        ++matched;
+        pos = end;
+        rest = end;
+    }
+
+    while(rest < p.size() && p[rest] == sep) {
+        ++rest;
+    }
+
+    for(std::size_t i = matched; i < parts_.size(); ++i) {
+        if(!out.empty()) {
+            out += sep;
+        }
+        out += "..";
+    }
+
+    if(rest < p.size()) {
+        if(!out.empty()) {
+            out += sep;
+        }
+        out.append(p, rest, Path::npos);
+    }
+
+    if(out.empty()) {
+        out = ".";
+    }
+}
+
+Path rel_path(const Path& path, const Path& start) {
+    if(path.empty()) {
+        return "";
+    }
+
+    return Relativizer(start).relativize(path);
+}
+
+#ifndef _arch_dreamcast
+#ifndef __WIN32__
+static Path get_env_var(const Path& name) {
+    char* env = getenv(name.c_str());
+    if(env) {
+        return Path(env);
+    }
+
+    return Path();
+}
+#endif
+#endif
+
+Path expand_user(const Path& path) {
+#ifdef _arch_dreamcast
+    return path;
+#else
+    Path cp = path;
 
     if(!starts_with(path, "~")) {
         return path;
@@ -874,6 +1611,21 @@ std::vector<Path> list_dir(const Path& path) {
     return result;
 }
 
+std::vector<DirEntry> scan_dir(const Path& path, std::size_t buffer_size) {
+    std::vector<DirEntry> result;
+
+    DirReader reader(path, buffer_size);
+    while(reader.next()) {
+        DirEntry entry;
+        entry.name = reader.name();
+        entry.ino = reader.ino();
+        entry.type = reader.type();
+        result.push_back(std::move(entry));
+    }
+
+    return result;
+}
+
 std::string read_file_contents(const Path& path) {
     std::ifstream t(path);
     std::string str((std::istreambuf_iterator<char>(t)),
@@ -884,32 +1636,4806 @@ std::string read_file_contents(const Path& path) {
 
 
 std::pair<Path, Path> split_ext(const Path& path) {
-    auto SEP_index = path.rfind(SEP);
-    auto dot_index = path.rfind(".");
+    auto parts = split_ext_view(path);
+    return std::make_pair(Path(parts.first), Path(parts.second));
+}
+
+#ifdef KFS_HAS_PMR
+std::pmr::string join(std::string_view p1, std::string_view p2, std::pmr::memory_resource* resource) {
+    std::pmr::string result(resource);
+    result.reserve(p1.size() + 1 + p2.size());
+    result.append(p1).append(1, SEP).append(p2);
+    return result;
+}
+
+std::pmr::string norm_path(std::string_view path, std::pmr::memory_resource* resource) {
+    std::pmr::string result(resource);
+#ifdef __WIN32__
+    result = nt_norm_path(Path(path));
+#else
+    norm_path_into(path, result);
+#endif
+    return result;
+}
+
+std::pmr::string dir_name(std::string_view path, std::pmr::memory_resource* resource) {
+    return std::pmr::string(split_view(path).first, resource);
+}
+
+std::pair<std::pmr::string, std::pmr::string> split(std::string_view path, std::pmr::memory_resource* resource) {
+    auto parts = split_view(path);
+    return std::make_pair(std::pmr::string(parts.first, resource), std::pmr::string(parts.second, resource));
+}
+
+std::pair<std::pmr::string, std::pmr::string> split_ext(std::string_view path, std::pmr::memory_resource* resource) {
+    auto parts = split_ext_view(path);
+    return std::make_pair(std::pmr::string(parts.first, resource), std::pmr::string(parts.second, resource));
+}
+
+std::pmr::vector<std::pmr::string> list_dir(std::string_view path, std::pmr::memory_resource* resource) {
+    std::pmr::vector<std::pmr::string> result(resource);
+
+#ifdef KFS_POSIX
+    /* readdir rather than DirReader, whose buffer would come from the heap */
+    std::pmr::string dir(path, resource);
+    DIR* dirp = ::opendir(dir.c_str());
+    if(!dirp) {
+        throw IOError(errno);
+    }
+
+    while(dirent* dp = ::readdir(dirp)) {
+        if(strcmp(dp->d_name, ".") != 0 && strcmp(dp->d_name, "..") != 0) {
+            result.emplace_back(dp->d_name);
+        }
+    }
+    ::closedir(dirp);
+#else
+    for(auto& name: list_dir(Path(path))) {
+        result.emplace_back(name);
+    }
+#endif
+
+    return result;
+}
+#endif
+
+
+
+}
+
+// ================================================================================================
+// Directory reading
+// ================================================================================================
+
+#ifdef KFS_POSIX
+static EntryType entry_type_from_dirent(unsigned char type) {
+#ifdef DT_UNKNOWN
+    switch(type) {
+        case DT_REG: return ENTRY_TYPE_FILE;
+        case DT_DIR: return ENTRY_TYPE_DIR;
+        case DT_LNK: return ENTRY_TYPE_LINK;
+        case DT_UNKNOWN: return ENTRY_TYPE_UNKNOWN;
+        default:
+            return ENTRY_TYPE_OTHER;
+    }
+#else
+    (void) (type);
+    return ENTRY_TYPE_UNKNOWN;
+#endif
+}
+
+static bool is_dot_or_dotdot(const char* name) {
+    return name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+#endif
+
+#if defined(__linux__) && defined(__GLIBC__)
+static ssize_t read_dirents(int fd, char* buffer, std::size_t size) {
+#if __GLIBC_PREREQ(2, 30)
+    return ::getdents64(fd, buffer, size);
+#else
+    return ::syscall(SYS_getdents64, fd, buffer, size);
+#endif
+}
+#endif
+
+const std::size_t DirReader::DEFAULT_BUFFER_SIZE;
+
+DirReader::DirReader(const Path& path, std::size_t buffer_size) {
+#if defined(__linux__) && defined(__GLIBC__)
+    fd_ = ::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(fd_ < 0) {
+        throw IOError(errno);
+    }
+
+    buffer_.resize(std::max<std::size_t>(buffer_size, sizeof(struct dirent64) + 256));
+#elif defined(KFS_POSIX)
+    (void) (buffer_size);
+
+    dir_ = ::opendir(path.c_str());
+    if(!dir_) {
+        throw IOError(errno);
+    }
+#else
+    (void) (path);
+    (void) (buffer_size);
+    throw std::logic_error("Not implemented");
+#endif
+}
+
+int DirReader::fd() const {
+#if defined(__linux__) && defined(__GLIBC__)
+    return fd_;
+#elif defined(KFS_POSIX)
+    return ::dirfd((DIR*) dir_);
+#else
+    return -1;
+#endif
+}
+
+DirReader::~DirReader() {
+#ifdef KFS_POSIX
+    if(fd_ >= 0) {
+        ::close(fd_);
+    }
+
+    if(dir_) {
+        ::closedir((DIR*) dir_);
+    }
+#endif
+}
+
+bool DirReader::next() {
+#if defined(__linux__) && defined(__GLIBC__)
+    for(;;) {
+        if(pos_ >= end_) {
+            ssize_t n = read_dirents(fd_, &buffer_[0], buffer_.size());
+            if(n < 0) {
+                if(errno == EINTR) {
+                    continue;
+                }
+                throw IOError(errno);
+            } else if(n == 0) {
+                return false;
+            }
+
+            pos_ = 0;
+            end_ = n;
+        }
+
+        const struct dirent64* record = (const struct dirent64*) &buffer_[pos_];
+        pos_ += record->d_reclen;
+
+        if(is_dot_or_dotdot(record->d_name)) {
+            continue;
+        }
+
+        name_ = record->d_name;
+        ino_ = record->d_ino;
+        type_ = entry_type_from_dirent(record->d_type);
+        return true;
+    }
+#elif defined(KFS_POSIX)
+    for(;;) {
+        errno = 0;
+        dirent* dp = ::readdir((DIR*) dir_);
+        if(!dp) {
+            if(errno) {
+                throw IOError(errno);
+            }
+            return false;
+        }
+
+        if(is_dot_or_dotdot(dp->d_name)) {
+            continue;
+        }
+
+        name_ = dp->d_name;
+        ino_ = dp->d_ino;
+#if defined(_DIRENT_HAVE_D_TYPE) || defined(__APPLE__) || defined(__FreeBSD__)
+        type_ = entry_type_from_dirent(dp->d_type);
+#else
+        type_ = ENTRY_TYPE_UNKNOWN;
+#endif
+        return true;
+    }
+#else
+    return false;
+#endif
+}
+
+// ================================================================================================
+// Ignore rules
+// ================================================================================================
+
+static bool glob_match_class(const char*& p, const char* pe, char c) {
+    bool negate = (p < pe && (*p == '!' || *p == '^'));
+    if(negate) {
+        ++p;
+    }
+
+    bool matched = false;
+    bool first = true;
+    while(p < pe && (*p != ']' || first)) {
+        first = false;
+
+        unsigned char lo = *p++;
+        if(lo == '\\' && p < pe) {
+            lo = *p++;
+        }
+
+        unsigned char hi = lo;
+        if(p + 1 < pe && *p == '-' && p[1] != ']') {
+            ++p;
+            hi = *p++;
+            if(hi == '\\' && p < pe) {
+                hi = *p++;
+            }
+        }
+
+        if((unsigned char) c >= lo && (unsigned char) c <= hi) {
+            matched = true;
+        }
+    }
+
+    if(p == pe) {
+        /* Unterminated class, never matches */
+        return false;
+    }
+
+    ++p;
+    return matched != negate;
+}
+
+/* Matches s against a gitignore glob. * and ? don't cross a '/', while a
+ * "**" segment matches any number of directories */
+static bool glob_match(const char* ps, const char* p, const char* pe, const char* s, const char* se) {
+    while(p < pe) {
+        char c = *p;
+
+        if(c == '*') {
+            bool segment_start = (p == ps || p[-1] == '/');
+            if(segment_start && p + 1 < pe && p[1] == '*' && (p + 2 == pe || p[2] == '/')) {
+                if(p + 2 == pe) {
+                    return true;
+                }
+
+                const char* rest = p + 3;
+                if(glob_match(ps, rest, pe, s, se)) {
+                    return true;
+                }
+
+                for(const char* q = s; q < se; ++q) {
+                    if(*q == '/' && glob_match(ps, rest, pe, q + 1, se)) {
+                        return true;
+                    }
+                }
+                return false;
+            }
+
+            while(p < pe && *p == '*') {
+                ++p;
+            }
+
+            for(const char* q = s; ; ++q) {
+                if(glob_match(ps, p, pe, q, se)) {
+                    return true;
+                }
+
+                if(q == se || *q == '/') {
+                    return false;
+                }
+            }
+        } else if(c == '?') {
+            if(s == se || *s == '/') {
+                return false;
+            }
+            ++p;
+            ++s;
+        } else if(c == '[') {
+            if(s == se || *s == '/') {
+                return false;
+            }
+
+            const char* q = p + 1;
+            if(!glob_match_class(q, pe, *s)) {
+                return false;
+            }
+            p = q;
+            ++s;
+        } else {
+            if(c == '\\' && p + 1 < pe) {
+                c = *++p;
+            }
+
+            if(s == se || *s != c) {
+                return false;
+            }
+            ++p;
+            ++s;
+        }
+    }
+
+    return s == se;
+}
+
+IgnoreRules IgnoreRules::from_file(const Path& file) {
+    std::ifstream in(file.c_str(), std::ios::binary);
+    if(!in) {
+        throw IOError(errno);
+    }
+
+    IgnoreRules rules;
+    rules.add_lines(std::string((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>()));
+    return rules;
+}
+
+void IgnoreRules::add_lines(const std::string& text) {
+    std::string::size_type start = 0;
+    while(start < text.size()) {
+        auto end = text.find('\n', start);
+        if(end == std::string::npos) {
+            end = text.size();
+        }
+
+        add(text.substr(start, end - start));
+        start = end + 1;
+    }
+}
+
+void IgnoreRules::add(const std::string& line) {
+    std::string pattern = line;
+
+    if(!pattern.empty() && pattern.back() == '\r') {
+        pattern.pop_back();
+    }
+
+    /* Trailing spaces are dropped unless they're escaped */
+    while(!pattern.empty() && pattern.back() == ' ' &&
+        !(pattern.size() > 1 && pattern[pattern.size() - 2] == '\\')) {
+        pattern.pop_back();
+    }
+
+    if(pattern.empty() || pattern[0] == '#') {
+        return;
+    }
+
+    Rule rule;
+    rule.negate = false;
+    rule.dir_only = false;
+
+    if(pattern[0] == '!') {
+        rule.negate = true;
+        pattern.erase(0, 1);
+    } else if(pattern[0] == '\\' && pattern.size() > 1 && (pattern[1] == '!' || pattern[1] == '#')) {
+        pattern.erase(0, 1);
+    }
+
+    if(!pattern.empty() && pattern.back() == '/') {
+        rule.dir_only = true;
+        pattern.pop_back();
+    }
+
+    rule.anchored = pattern.find('/') != std::string::npos;
+    if(!pattern.empty() && pattern[0] == '/') {
+        pattern.erase(0, 1);
+    }
+
+    if(pattern.empty()) {
+        return;
+    }
+
+    const char* wildcards = "*?[\\";
+    if(pattern.find_first_of(wildcards) == std::string::npos) {
+        rule.kind = RULE_LITERAL;
+    } else if(!rule.anchored && pattern[0] == '*' && pattern.find_first_of(wildcards, 1) == std::string::npos) {
+        rule.kind = RULE_SUFFIX;
+        pattern.erase(0, 1);
+    } else {
+        rule.kind = RULE_GLOB;
+    }
+
+    rule.pattern = pattern;
+    rules_.push_back(rule);
+}
 
-    if(SEP_index == Path::npos) {
-        SEP_index = -1;
+IgnoreMatch IgnoreRules::match(const Path& relative, bool is_dir) const {
+    auto slash = relative.rfind('/');
+    if(slash == Path::npos) {
+        return match(Path(), relative.c_str(), is_dir);
     }
 
-    if(dot_index > SEP_index) {
-        auto filename_index = SEP_index + 1;
+    return match(relative.substr(0, slash), relative.c_str() + slash + 1, is_dir);
+}
+
+IgnoreMatch IgnoreRules::match(const Path& dir, const char* name, bool is_dir) const {
+    const std::size_t name_length = strlen(name);
+    Path full;
+
+    for(auto it = rules_.rbegin(); it != rules_.rend(); ++it) {
+        const Rule& rule = *it;
+        if(rule.dir_only && !is_dir) {
+            continue;
+        }
+
+        const char* s = name;
+        std::size_t length = name_length;
+
+        if(rule.anchored) {
+            if(full.empty()) {
+                full = (dir.empty()) ? Path(name) : dir + "/" + name;
+            }
+            s = full.c_str();
+            length = full.size();
+        }
+
+        bool hit = false;
+        switch(rule.kind) {
+            case RULE_LITERAL:
+                hit = rule.pattern.size() == length && memcmp(rule.pattern.data(), s, length) == 0;
+            break;
+            case RULE_SUFFIX:
+                hit = rule.pattern.size() <= length &&
+                    memcmp(rule.pattern.data(), s + length - rule.pattern.size(), rule.pattern.size()) == 0;
+            break;
+            case RULE_GLOB: {
+                const char* p = rule.pattern.c_str();
+                hit = glob_match(p, p, p + rule.pattern.size(), s, s + length);
+            } break;
+        }
+
+        if(hit) {
+            return (rule.negate) ? IGNORE_MATCH_INCLUDED : IGNORE_MATCH_IGNORED;
+        }
+    }
+
+    return IGNORE_MATCH_NONE;
+}
 
-        while(filename_index < dot_index) {
-            if(path[filename_index] != '.') {
-                return std::make_pair(
-                    slice(path, nullptr, dot_index),
-                    slice(path, dot_index, nullptr)
-                );
+// ================================================================================================
+// Tree walking and find
+// ================================================================================================
+
+struct IgnoreLayer {
+    std::shared_ptr<const IgnoreLayer> parent;
+    IgnoreRules rules;
+    Path base;      /* The directory the rules apply to, relative to the walk root */
+};
+
+struct WalkTask {
+    Path path;
+    Path relative;
+    uint32_t depth;
+    std::shared_ptr<const IgnoreLayer> ignore;
+};
+
+typedef std::function<void (const WalkTask&, std::vector<WalkTask>&)> WalkVisitor;
+
+/* Visits root and, through the tasks each visit appends, the rest of the
+ * tree across a pool of threads. Setting stop abandons the walk early. */
+static void walk_parallel(const WalkTask& root, uint32_t threads, const WalkVisitor& visit, std::atomic<bool>& stop,
+                          IoBudget* budget=nullptr) {
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::vector<WalkTask> pending(1, root);
+    std::size_t active = 0;
+    std::exception_ptr error;
+
+    auto run = [&]() {
+        ScopedIoPriority priority(budget);
+        std::vector<WalkTask> children;
+        std::unique_lock<std::mutex> lock(mutex);
+
+        for(;;) {
+            cond.wait(lock, [&]() {
+                return !pending.empty() || active == 0 || error || stop;
+            });
+
+            if(error || stop || pending.empty()) {
+                cond.notify_all();
+                return;
+            }
+
+            WalkTask task = std::move(pending.back());
+            pending.pop_back();
+            ++active;
+            lock.unlock();
+
+            children.clear();
+            try {
+                visit(task, children);
+            } catch(...) {
+                lock.lock();
+                if(!error) {
+                    error = std::current_exception();
+                }
+                --active;
+                cond.notify_all();
+                return;
+            }
+
+            lock.lock();
+            --active;
+            for(auto& child: children) {
+                pending.push_back(std::move(child));
             }
-            filename_index += 1;
+            cond.notify_all();
         }
+    };
+
+    std::vector<std::thread> pool;
+    for(uint32_t i = 1; i < thread_count(threads); ++i) {
+        pool.push_back(std::thread(run));
+    }
+
+    run();
+
+    for(auto& thread: pool) {
+        thread.join();
     }
 
-    return std::make_pair(path, "");
+    if(error) {
+        std::rethrow_exception(error);
+    }
 }
 
+static EntryType entry_type_from_mode(mode_t mode) {
+    if(S_ISDIR(mode)) {
+        return ENTRY_TYPE_DIR;
+    } else if(S_ISREG(mode)) {
+        return ENTRY_TYPE_FILE;
+#ifdef S_ISLNK
+    } else if(S_ISLNK(mode)) {
+        return ENTRY_TYPE_LINK;
+#endif
+    }
 
+    return ENTRY_TYPE_OTHER;
+}
 
+bool Query::needs_stat() const {
+    return min_size_ > 0 || max_size_ != std::numeric_limits<off_t>::max() ||
+        modified_after_ > 0 || modified_before_ != std::numeric_limits<uint64_t>::max() ||
+        has_uid_ || bool(where_) || order_ != FIND_ORDER_NONE;
+}
+
+/* True if lhs should come before rhs in the results */
+static bool find_order_before(FindOrder order, const FoundEntry& lhs, const FoundEntry& rhs) {
+    switch(order) {
+        case FIND_ORDER_LARGEST: return lhs.st.size > rhs.st.size;
+        case FIND_ORDER_SMALLEST: return lhs.st.size < rhs.st.size;
+        case FIND_ORDER_NEWEST: return lhs.st.mtime_ns > rhs.st.mtime_ns;
+        case FIND_ORDER_OLDEST: return lhs.st.mtime_ns < rhs.st.mtime_ns;
+        default:
+            return false;
+    }
+}
+
+std::vector<FoundEntry> find(const Path& root, const Query& query) {
+#ifdef KFS_POSIX
+    const bool needs_stat = query.needs_stat();
+
+    std::mutex results_mutex;
+    std::vector<FoundEntry> results;
+    std::atomic<bool> stop(false);
+
+    auto before = [&query](const FoundEntry& lhs, const FoundEntry& rhs) {
+        return find_order_before(query.order_, lhs, rhs);
+    };
+
+    auto add_results = [&](std::vector<FoundEntry>& found) {
+        std::lock_guard<std::mutex> lock(results_mutex);
+
+        for(auto& entry: found) {
+            if(query.order_ == FIND_ORDER_NONE) {
+                if(query.limit_ && results.size() >= query.limit_) {
+                    break;
+                }
+                results.push_back(std::move(entry));
+            } else if(!query.limit_ || results.size() < query.limit_) {
+                /* A heap with the entry that would be dropped next on top */
+                results.push_back(std::move(entry));
+                std::push_heap(results.begin(), results.end(), before);
+            } else if(before(entry, results.front())) {
+                std::pop_heap(results.begin(), results.end(), before);
+                results.back() = std::move(entry);
+                std::push_heap(results.begin(), results.end(), before);
+            }
+        }
+
+        if(query.order_ == FIND_ORDER_NONE && query.limit_ && results.size() >= query.limit_) {
+            stop = true;
+        }
+
+        found.clear();
+    };
+
+    auto visit = [&](const WalkTask& task, std::vector<WalkTask>& children) {
+        charge(query.budget_, 1);
+
+        std::unique_ptr<DirReader> reader;
+        try {
+            reader.reset(new DirReader(task.path));
+        } catch(IOError&) {
+            if(task.depth == 0) {
+                throw;
+            }
+
+            /* Unreadable or vanished subdirectories are skipped, like find(1) */
+            return;
+        }
+
+        const uint32_t depth = task.depth + 1;
+        const bool reportable = depth >= query.min_depth_;
+        const bool descend = depth < query.max_depth_;
+
+        std::shared_ptr<const IgnoreLayer> ignore = task.ignore;
+        if(!query.ignore_file_.empty()) {
+            std::string text;
+            if(read_file_at(reader->fd(), query.ignore_file_.c_str(), text)) {
+                std::shared_ptr<IgnoreLayer> layer = std::make_shared<IgnoreLayer>();
+                layer->parent = ignore;
+                layer->rules.add_lines(text);
+                layer->base = task.relative;
+                ignore = layer;
+            }
+        }
+
+        /* Where this directory is relative to each layer of rules */
+        std::vector<std::pair<const IgnoreLayer*, Path>> layers;
+        for(const IgnoreLayer* layer = ignore.get(); layer; layer = layer->parent.get()) {
+            Path dir = task.relative;
+            if(!layer->base.empty()) {
+                dir = (dir.size() == layer->base.size()) ? Path() : dir.substr(layer->base.size() + 1);
+            }
+            layers.push_back(std::make_pair(layer, dir));
+        }
+
+        auto ignored = [&layers](const char* name, bool is_dir) -> bool {
+            for(auto& layer: layers) {
+                auto match = layer.first->rules.match(layer.second, name, is_dir);
+                if(match != IGNORE_MATCH_NONE) {
+                    return match == IGNORE_MATCH_IGNORED;
+                }
+            }
+            return false;
+        };
+
+        std::vector<FoundEntry> found;
+        struct ::stat result;
+
+        auto stat_at = [&](const char* name) -> bool {
+            charge(query.budget_, 1);
+            return ::fstatat(reader->fd(), name, &result, AT_SYMLINK_NOFOLLOW) == 0;
+        };
+
+        while(!stop && reader->next()) {
+            const char* name = reader->name();
+            EntryType type = reader->type();
+
+            bool matches = reportable &&
+                (query.name_.empty() || ::fnmatch(query.name_.c_str(), name, 0) == 0);
+
+            bool stat_done = false;
+            bool type_needed = descend || !layers.empty() || (matches && query.type_ != ENTRY_TYPE_UNKNOWN);
+            if(type == ENTRY_TYPE_UNKNOWN && type_needed) {
+                if(!stat_at(name)) {
+                    continue;
+                }
+
+                stat_done = true;
+                type = entry_type_from_mode(result.st_mode);
+            }
+
+            if(!layers.empty() && ignored(name, type == ENTRY_TYPE_DIR)) {
+                continue;
+            }
+
+            if(type == ENTRY_TYPE_DIR && descend) {
+                WalkTask child;
+                child.path = path::join(task.path, name);
+                child.relative = join_rel(task.relative, name);
+                child.depth = depth;
+                child.ignore = ignore;
+                children.push_back(std::move(child));
+            }
+
+            if(!matches || (query.type_ != ENTRY_TYPE_UNKNOWN && type != query.type_)) {
+                continue;
+            }
+
+            FoundEntry entry;
+            entry.path = path::join(task.path, name);
+            entry.type = type;
+            entry.depth = depth;
+            entry.has_stat = false;
+            entry.st = Stat();
+
+            if(needs_stat) {
+                if(!stat_done && !stat_at(name)) {
+                    continue;
+                }
+
+                fill_stat(result, entry.st);
+                entry.has_stat = true;
+
+                if(entry.st.size < query.min_size_ || entry.st.size > query.max_size_ ||
+                    entry.st.mtime_ns < query.modified_after_ || entry.st.mtime_ns > query.modified_before_ ||
+                    (query.has_uid_ && entry.st.uid != query.uid_) ||
+                    (query.where_ && !query.where_(entry))) {
+                    continue;
+                }
+            }
+
+            found.push_back(std::move(entry));
+        }
+
+        if(!found.empty()) {
+            add_results(found);
+        }
+    };
+
+    WalkTask start;
+    start.path = root;
+    start.depth = 0;
+
+    if(!query.ignore_.empty()) {
+        std::shared_ptr<IgnoreLayer> layer = std::make_shared<IgnoreLayer>();
+        layer->rules = query.ignore_;
+        start.ignore = layer;
+    }
+
+    walk_parallel(start, query.threads_, visit, stop, query.budget_);
+
+    if(query.order_ != FIND_ORDER_NONE) {
+        std::sort(results.begin(), results.end(), before);
+    }
+
+    return results;
+#else
+    (void) (root);
+    (void) (query);
+    throw std::logic_error("Not implemented");
+#endif
+}
+
+// ================================================================================================
+// Content hashing
+//
+// The hash is modelled on XXH3's long input loop: eight 64-bit lanes which
+// each take a 32x32->64 multiply of the input mixed with a secret, scrambled
+// every 1KiB. It's not compatible with the reference xxHash output, but it is
+// stable across platforms and builds so hashes can be stored on disk.
+// ================================================================================================
+
+static const uint64_t PRIME32_1 = 0x9E3779B1U;
+static const uint64_t PRIME32_2 = 0x85EBCA77U;
+static const uint64_t PRIME32_3 = 0xC2B2AE3DU;
+static const uint64_t PRIME64_1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t PRIME64_3 = 0x165667B19E3779F9ULL;
+static const uint64_t PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+static const std::size_t HASH_STRIPE = 64;
+static const std::size_t HASH_STRIPES_PER_BLOCK = 16;
+static const std::size_t HASH_SECRET_WORDS = 8 + HASH_STRIPES_PER_BLOCK + 8;
+
+static const uint64_t* hash_secret() {
+    struct Secret {
+        uint64_t words[HASH_SECRET_WORDS];
+
+        Secret() {
+            /* splitmix64, just to get some well distributed constants */
+            uint64_t state = PRIME64_1;
+            for(auto& word: words) {
+                uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+                z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+                z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+                word = z ^ (z >> 31);
+            }
+        }
+    };
+
+    static const Secret secret;
+    return secret.words;
+}
+
+static inline uint64_t read_le64(const uint8_t* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+static inline uint64_t mul_fold64(uint64_t lhs, uint64_t rhs) {
+#ifdef __SIZEOF_INT128__
+    __uint128_t product = (__uint128_t) lhs * rhs;
+    return uint64_t(product) ^ uint64_t(product >> 64);
+#else
+    uint64_t lo_lo = (lhs & 0xFFFFFFFF) * (rhs & 0xFFFFFFFF);
+    uint64_t hi_lo = (lhs >> 32) * (rhs & 0xFFFFFFFF);
+    uint64_t lo_hi = (lhs & 0xFFFFFFFF) * (rhs >> 32);
+    uint64_t hi_hi = (lhs >> 32) * (rhs >> 32);
+
+    uint64_t cross = (lo_lo >> 32) + (hi_lo & 0xFFFFFFFF) + lo_hi;
+    uint64_t upper = (hi_lo >> 32) + (cross >> 32) + hi_hi;
+    uint64_t lower = (cross << 32) | (lo_lo & 0xFFFFFFFF);
+    return lower ^ upper;
+#endif
+}
+
+static inline void hash_accumulate(uint64_t* acc, const uint8_t* data, const uint64_t* secret) {
+#if defined(__SSE2__) && !(defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+    for(std::size_t i = 0; i < 4; ++i) {
+        __m128i a = _mm_loadu_si128((const __m128i*) (acc + i * 2));
+        __m128i d = _mm_loadu_si128((const __m128i*) (data + i * 16));
+        __m128i k = _mm_loadu_si128((const __m128i*) (secret + i * 2));
+
+        __m128i dk = _mm_xor_si128(d, k);
+        __m128i dk_hi = _mm_shuffle_epi32(dk, _MM_SHUFFLE(0, 3, 0, 1));
+        __m128i product = _mm_mul_epu32(dk, dk_hi);
+        __m128i swapped = _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2));
+
+        a = _mm_add_epi64(a, swapped);
+        _mm_storeu_si128((__m128i*) (acc + i * 2), _mm_add_epi64(a, product));
+    }
+#else
+    for(std::size_t i = 0; i < 8; ++i) {
+        uint64_t d = read_le64(data + i * 8);
+        uint64_t k = d ^ secret[i];
+        acc[i ^ 1] += d;
+        acc[i] += (k & 0xFFFFFFFF) * (k >> 32);
+    }
+#endif
+}
+
+static inline void hash_scramble(uint64_t* acc, const uint64_t* secret) {
+    for(std::size_t i = 0; i < 8; ++i) {
+        uint64_t a = acc[i];
+        a ^= a >> 47;
+        a ^= secret[i];
+        acc[i] = a * PRIME32_1;
+    }
+}
+
+class Hasher {
+public:
+    Hasher() {
+        const uint64_t init[8] = {
+            PRIME32_3, PRIME64_1, PRIME64_2, PRIME64_3,
+            PRIME64_4, PRIME32_2, PRIME64_5, PRIME32_1
+        };
+        memcpy(acc_, init, sizeof(acc_));
+    }
+
+    void update(const void* data, std::size_t length) {
+        const uint8_t* p = (const uint8_t*) data;
+        total_ += length;
+
+        if(buffered_) {
+            std::size_t n = std::min(length, HASH_STRIPE - buffered_);
+            memcpy(buffer_ + buffered_, p, n);
+            buffered_ += n;
+            p += n;
+            length -= n;
+
+            if(buffered_ < HASH_STRIPE) {
+                return;
+            }
+
+            consume(buffer_);
+            buffered_ = 0;
+        }
+
+        while(length >= HASH_STRIPE) {
+            consume(p);
+            p += HASH_STRIPE;
+            length -= HASH_STRIPE;
+        }
+
+        memcpy(buffer_, p, length);
+        buffered_ = length;
+    }
+
+    void update(const std::string& str) {
+        update(str.data(), str.size());
+    }
+
+    Hash digest() const {
+        const uint64_t* secret = hash_secret();
+
+        uint64_t acc[8];
+        memcpy(acc, acc_, sizeof(acc));
+
+        if(buffered_) {
+            uint8_t last[HASH_STRIPE] = {0};
+            memcpy(last, buffer_, buffered_);
+            hash_accumulate(acc, last, secret + stripe_);
+        }
+
+        uint64_t result = total_ * PRIME64_1;
+        for(std::size_t i = 0; i < 4; ++i) {
+            const uint64_t* s = secret + HASH_STRIPES_PER_BLOCK + 8 + i * 2;
+            result += mul_fold64(acc[i * 2] ^ s[0], acc[i * 2 + 1] ^ s[1]);
+        }
+
+        result ^= result >> 37;
+        result *= 0x165667919E3779F9ULL;
+        result ^= result >> 32;
+        return result;
+    }
+
+private:
+    void consume(const uint8_t* stripe) {
+        const uint64_t* secret = hash_secret();
+
+        hash_accumulate(acc_, stripe, secret + stripe_);
+        if(++stripe_ == HASH_STRIPES_PER_BLOCK) {
+            hash_scramble(acc_, secret + HASH_STRIPES_PER_BLOCK);
+            stripe_ = 0;
+        }
+    }
+
+    uint64_t acc_[8];
+    uint8_t buffer_[HASH_STRIPE];
+    std::size_t buffered_ = 0;
+    std::size_t stripe_ = 0;
+    uint64_t total_ = 0;
+};
+
+static const off_t HASH_FADVISE_THRESHOLD = 256 * 1024;
+static const std::size_t HASH_READ_BUFFER = 1024 * 1024;
+
+Hash hash_bytes(const void* data, std::size_t length) {
+    Hasher hasher;
+    hasher.update(data, length);
+    return hasher.digest();
+}
+
+Hash hash_file(const Path& path, IoBudget* budget) {
+    Hasher hasher;
+    ScopedIoPriority priority(budget);
+
+#ifdef KFS_POSIX
+    ScopedFD fd(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    if(fd.get() < 0) {
+        throw IOError(errno);
+    }
+
+    struct ::stat st;
+    if(::fstat(fd.get(), &st) != 0) {
+        throw IOError(errno);
+    }
+
+    /* Read rather than mapped: touching the missing pages of a mapping of a
+     * file truncated while it's being hashed (say by a build running in the
+     * tree) would kill us with SIGBUS. Reading just comes up short, which is
+     * reported as IOError(EAGAIN) below */
+#ifdef POSIX_FADV_SEQUENTIAL
+    if(S_ISREG(st.st_mode) && st.st_size >= HASH_FADVISE_THRESHOLD) {
+        ::posix_fadvise(fd.get(), 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+#endif
+
+    std::vector<char> buffer(HASH_READ_BUFFER);
+    off_t total = 0;
+    for(;;) {
+        ssize_t n = ::read(fd.get(), &buffer[0], buffer.size());
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            throw IOError(errno);
+        } else if(n == 0) {
+            break;
+        }
+
+        charge(budget, 1, n);
+        hasher.update(&buffer[0], n);
+        total += n;
+    }
+
+    /* Truncated part way through, so the hash is of neither version */
+    if(S_ISREG(st.st_mode) && total < st.st_size) {
+        throw IOError(EAGAIN);
+    }
+#else
+    std::ifstream file(path.c_str(), std::ios::binary);
+    if(!file) {
+        throw IOError("Unable to open file for hashing");
+    }
+
+    std::vector<char> buffer(HASH_READ_BUFFER);
+    while(file) {
+        file.read(&buffer[0], buffer.size());
+        charge(budget, 1, file.gcount());
+        hasher.update(&buffer[0], file.gcount());
+    }
+#endif
+
+    return hasher.digest();
+}
+
+static Hash hash_link(const Path& path) {
+    Hasher hasher;
+    hasher.update(read_link(path));
+    return hasher.digest();
+}
+
+Hash hash_tree(const Path& path, HashCache* cache, uint32_t threads, IoBudget* budget) {
+    struct Node {
+        Path path;
+        Path name;
+        char type;
+        Stat st;
+        Hash hash;
+        std::vector<std::size_t> children;
+    };
+
+    std::vector<Node> nodes;
+
+    auto add_node = [&](const Path& full, const Path& name) -> std::size_t {
+        Node node;
+        node.path = full;
+        node.name = name;
+        node.hash = 0;
+
+        charge(budget, 1);
+        if(!lstat_nofollow(full, node.st)) {
+            throw IOError(errno);
+        }
+
+        node.type = entry_kind(node.st);
+
+        nodes.push_back(node);
+        return nodes.size() - 1;
+    };
+
+    add_node(path, Path());
+
+    /* Breadth first, so every directory appears before its children */
+    std::vector<std::size_t> files;
+    for(std::size_t i = 0; i < nodes.size(); ++i) {
+        if(nodes[i].type == 'd') {
+            auto names = path::list_dir(nodes[i].path);
+            std::sort(names.begin(), names.end());
+
+            for(auto& name: names) {
+                std::size_t child = add_node(path::join(nodes[i].path, name), name);
+                nodes[i].children.push_back(child);
+            }
+        } else if(nodes[i].type != 'o') {
+            files.push_back(i);
+        }
+    }
+
+    std::vector<bool> cached(files.size(), false);
+    if(cache) {
+        for(std::size_t i = 0; i < files.size(); ++i) {
+            Node& node = nodes[files[i]];
+            auto it = cache->find(node.path);
+            if(it != cache->end() &&
+                it->second.ino == node.st.ino &&
+                it->second.size == node.st.size &&
+                it->second.mtime_ns == node.st.mtime_ns) {
+
+                node.hash = it->second.hash;
+                cached[i] = true;
+            }
+        }
+    }
+
+    parallel_for(files.size(), threads, [&](std::size_t i) {
+        if(cached[i]) {
+            return;
+        }
+
+        Node& node = nodes[files[i]];
+        node.hash = (node.type == 'l') ? hash_link(node.path) : hash_file(node.path, budget);
+    }, budget);
+
+    for(std::size_t i = nodes.size(); i-- > 0;) {
+        Node& node = nodes[i];
+        if(node.type == 'o') {
+            node.hash = hash_bytes(&node.st.mode, sizeof(node.st.mode));
+        } else if(node.type == 'd') {
+            Hasher hasher;
+            for(auto child: node.children) {
+                uint8_t hash[8];
+                for(int j = 0; j < 8; ++j) {
+                    hash[j] = uint8_t(nodes[child].hash >> (j * 8));
+                }
+
+                hasher.update(&nodes[child].type, 1);
+                hasher.update(nodes[child].name.c_str(), nodes[child].name.size() + 1);
+                hasher.update(hash, sizeof(hash));
+            }
+            node.hash = hasher.digest();
+        }
+    }
+
+    if(cache) {
+        HashCache fresh;
+        for(auto i: files) {
+            HashCacheEntry entry;
+            entry.ino = nodes[i].st.ino;
+            entry.size = nodes[i].st.size;
+            entry.mtime_ns = nodes[i].st.mtime_ns;
+            entry.hash = nodes[i].hash;
+            fresh[nodes[i].path] = entry;
+        }
+        cache->swap(fresh);
+    }
+
+    return nodes[0].hash;
+}
+
+// ================================================================================================
+// Tree diff and sync
+// ================================================================================================
+
+static std::vector<Path> sorted_dir(const Path& path) {
+    if(!path::exists(path)) {
+        return std::vector<Path>();
+    }
+
+    auto names = path::list_dir(path);
+    std::sort(names.begin(), names.end());
+    return names;
+}
+
+static void add_subtree(const Path& root, const Path& rel, std::vector<Path>& out) {
+    out.push_back(rel);
+
+    Stat st;
+    Path full = path::join(root, rel);
+    if(lstat_nofollow(full, st) && S_ISDIR(st.mode)) {
+        for(auto& name: sorted_dir(full)) {
+            add_subtree(root, path::join(rel, name), out);
+        }
+    }
+}
+
+static void diff_dir(const Path& a, const Path& b, const Path& rel, bool compare_content,
+                     TreeDiff& diff, std::vector<Path>& same_size) {
+
+    auto lhs = sorted_dir(join_rel(a, rel));
+    auto rhs = sorted_dir(join_rel(b, rel));
+
+    auto l = lhs.begin();
+    auto r = rhs.begin();
+
+    while(l != lhs.end() || r != rhs.end()) {
+        if(r == rhs.end() || (l != lhs.end() && *l < *r)) {
+            add_subtree(a, join_rel(rel, *l++), diff.removed);
+            continue;
+        } else if(l == lhs.end() || *r < *l) {
+            add_subtree(b, join_rel(rel, *r++), diff.added);
+            continue;
+        }
+
+        Path name = join_rel(rel, *l);
+        ++l;
+        ++r;
+
+        Stat sa, sb;
+        if(!lstat_nofollow(path::join(a, name), sa) || !lstat_nofollow(path::join(b, name), sb)) {
+            throw IOError(errno);
+        }
+
+        char kind = entry_kind(sa);
+        if(kind != entry_kind(sb)) {
+            add_subtree(a, name, diff.removed);
+            add_subtree(b, name, diff.added);
+        } else if(kind == 'd') {
+            diff_dir(a, b, name, compare_content, diff, same_size);
+        } else if(kind == 'f') {
+            if(sa.size != sb.size) {
+                diff.changed.push_back(name);
+            } else if(compare_content) {
+                same_size.push_back(name);
+            } else if(sa.mtime_ns != sb.mtime_ns) {
+                diff.changed.push_back(name);
+            }
+        } else if(kind == 'l') {
+            if(read_link(path::join(a, name)) != read_link(path::join(b, name))) {
+                diff.changed.push_back(name);
+            }
+        } else if(sa.mode != sb.mode || sa.rdev != sb.rdev) {
+            diff.changed.push_back(name);
+        }
+    }
+}
+
+TreeDiff diff_tree(const Path& a, const Path& b, bool compare_content, uint32_t threads, IoBudget* budget) {
+    for(auto& root: {a, b}) {
+        if(path::exists(root) && !path::is_dir(root)) {
+            throw IOError(ENOTDIR);
+        }
+    }
+
+    TreeDiff diff;
+    std::vector<Path> same_size;
+    diff_dir(a, b, Path(), compare_content, diff, same_size);
+
+    std::vector<char> differs(same_size.size(), 0);
+    parallel_for(same_size.size(), threads, [&](std::size_t i) {
+        differs[i] = hash_file(path::join(a, same_size[i]), budget) != hash_file(path::join(b, same_size[i]), budget);
+    }, budget);
+
+    for(std::size_t i = 0; i < same_size.size(); ++i) {
+        if(differs[i]) {
+            diff.changed.push_back(same_size[i]);
+        }
+    }
+
+    std::sort(diff.changed.begin(), diff.changed.end());
+    return diff;
+}
+
+TreeDiff sync_tree(const Path& source, const Path& dest, const SyncOptions& options) {
+    if(!path::is_dir(source)) {
+        throw IOError(ENOTDIR);
+    }
+
+    TreeDiff diff = diff_tree(dest, source, options.compare_content, options.threads, options.budget);
+    if(options.dry_run) {
+        return diff;
+    }
+
+#ifdef KFS_POSIX
+    if(!path::exists(dest)) {
+        make_dirs(dest);
+    }
+
+    /* Children are listed after their parents, so remove in reverse */
+    for(auto it = diff.removed.rbegin(); it != diff.removed.rend(); ++it) {
+        Path full = path::join(dest, *it);
+
+        Stat st;
+        if(!lstat_nofollow(full, st)) {
+            continue;
+        }
+
+        int ret = (S_ISDIR(st.mode)) ? ::rmdir(full.c_str()) : ::unlink(full.c_str());
+        if(ret != 0) {
+            throw IOError(errno);
+        }
+    }
+
+    std::vector<Path> copies;
+    for(auto& rel: diff.added) {
+        Stat st;
+        if(!lstat_nofollow(path::join(source, rel), st)) {
+            throw IOError(errno);
+        }
+
+        if(S_ISDIR(st.mode)) {
+            if(::mkdir(path::join(dest, rel).c_str(), st.mode & 07777) != 0) {
+                throw IOError(errno);
+            }
+        } else {
+            copies.push_back(rel);
+        }
+    }
+
+    copies.insert(copies.end(), diff.changed.begin(), diff.changed.end());
+
+    parallel_for(copies.size(), options.threads, [&](std::size_t i) {
+        Path from = path::join(source, copies[i]);
+        Path to = path::join(dest, copies[i]);
+
+        Stat st;
+        if(!lstat_nofollow(from, st)) {
+            throw IOError(errno);
+        }
+
+        switch(entry_kind(st)) {
+            case 'f': copy_file(from, to, options.budget); break;
+            case 'l': copy_link(from, to); break;
+            default:
+                /* Devices, fifos and sockets aren't copied */
+                break;
+        }
+    }, options.budget);
+#else
+    throw std::logic_error("Not implemented");
+#endif
+
+    return diff;
+}
+
+// ================================================================================================
+// Snapshots
+// ================================================================================================
+
+static const char SNAPSHOT_MAGIC[8] = {'K', 'F', 'S', 'S', 'N', 'A', 'P', '1'};
+static const uint32_t SNAPSHOT_BYTE_ORDER = 0x01020304;
+static const uint32_t NO_ENTRY = 0xFFFFFFFF;
+static const uint64_t SNAPSHOT_RACY_NS = 1000000000ull;
+
+static std::size_t pad8(std::size_t n) {
+    return (n + 7) & ~std::size_t(7);
+}
+
+static uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()
+    ).count();
+}
+
+static Snapshot::Entry make_entry(const Stat& st, uint32_t parent, const Path& name, std::vector<char>& names) {
+    Snapshot::Entry entry;
+    entry.ino = st.ino;
+    entry.size = st.size;
+    entry.mtime_ns = st.mtime_ns;
+    entry.mode = st.mode;
+    entry.parent = parent;
+    entry.first_child = 0;
+    entry.child_count = 0;
+    entry.name_offset = names.size();
+    entry.name_length = name.size();
+    names.insert(names.end(), name.begin(), name.end());
+    return entry;
+}
+
+static Path entry_path(const Snapshot::Entry* entries, const char* names, std::size_t i) {
+    std::vector<std::size_t> chain;
+    while(i != 0) {
+        chain.push_back(i);
+        i = entries[i].parent;
+    }
+
+    Path result;
+    for(auto it = chain.rbegin(); it != chain.rend(); ++it) {
+        if(!result.empty()) {
+            result += SEP;
+        }
+        result.append(names + entries[*it].name_offset, entries[*it].name_length);
+    }
+
+    return result;
+}
+
+Snapshot Snapshot::scan(const Path& root) {
+    Snapshot snapshot;
+    snapshot.root_ = root;
+    snapshot.refresh();
+    return snapshot;
+}
+
+/* Checks every index and name range in a loaded snapshot, so that a
+ * corrupt or foreign file can't send lookups out of bounds. Entries are
+ * written breadth first: a parent always comes before its children, which
+ * sit in a contiguous run after it */
+static bool valid_entries(const std::vector<Snapshot::Entry>& entries, std::size_t names_size) {
+    std::size_t count = entries.size();
+
+    for(std::size_t i = 0; i < count; ++i) {
+        const Snapshot::Entry& entry = entries[i];
+
+        if(uint64_t(entry.name_offset) + entry.name_length > names_size) {
+            return false;
+        }
+
+        if(entry.child_count && (entry.first_child <= i || uint64_t(entry.first_child) + entry.child_count > count)) {
+            return false;
+        }
+
+        if(i == 0) {
+            if(entry.parent != NO_ENTRY) {
+                return false;
+            }
+            continue;
+        }
+
+        if(entry.parent >= i) {
+            return false;
+        }
+
+        const Snapshot::Entry& parent = entries[entry.parent];
+        if(i < parent.first_child || i >= uint64_t(parent.first_child) + parent.child_count) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+Snapshot Snapshot::load(const Path& file) {
+    Snapshot snapshot;
+
+    /* Read rather than mapped, so a file truncated underneath us is an
+     * error rather than a SIGBUS */
+    std::vector<char> buffer;
+
+#ifdef KFS_POSIX
+    ScopedFD fd(::open(file.c_str(), O_RDONLY | O_CLOEXEC));
+    if(fd.get() < 0) {
+        throw IOError(errno);
+    }
+
+    struct ::stat st;
+    if(::fstat(fd.get(), &st) != 0) {
+        throw IOError(errno);
+    }
+
+    buffer.resize(st.st_size);
+    std::size_t done = 0;
+    while(done < buffer.size()) {
+        ssize_t n = ::pread(fd.get(), &buffer[done], buffer.size() - done, done);
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            throw IOError(errno);
+        } else if(n == 0) {
+            throw IOError("Snapshot file is truncated");
+        }
+        done += n;
+    }
+#else
+    std::ifstream in(file.c_str(), std::ios::binary);
+    if(!in) {
+        throw IOError("Unable to open snapshot");
+    }
+
+    buffer.assign((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+#endif
+
+    const char* data = buffer.data();
+    std::size_t size = buffer.size();
+
+    Header header;
+    if(size < sizeof(header)) {
+        throw IOError("Not a snapshot file");
+    }
+
+    memcpy(&header, data, sizeof(header));
+    if(memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 ||
+        header.byte_order != SNAPSHOT_BYTE_ORDER ||
+        header.entry_size != sizeof(Entry) ||
+        header.entry_count > NO_ENTRY) {
+        throw IOError("Not a snapshot file");
+    }
+
+    if(header.root_size > size || header.names_size > size) {
+        throw IOError("Snapshot file is truncated");
+    }
+
+    std::size_t entries_offset = sizeof(header) + pad8(header.root_size);
+    std::size_t names_offset = entries_offset + header.entry_count * sizeof(Entry);
+    if(names_offset > size || names_offset + header.names_size != size) {
+        throw IOError("Snapshot file is truncated");
+    }
+
+    std::vector<Entry> entries(header.entry_count);
+    memcpy(entries.data(), data + entries_offset, header.entry_count * sizeof(Entry));
+    if(!valid_entries(entries, header.names_size)) {
+        throw IOError("Snapshot file is corrupt");
+    }
+
+    std::vector<char> names(data + names_offset, data + size);
+
+    snapshot.root_ = Path(data + sizeof(header), header.root_size);
+    snapshot.scanned_ns_ = header.scanned_ns;
+    snapshot.adopt(entries, names);
+
+    return snapshot;
+}
+
+Snapshot::Snapshot(Snapshot&& other) {
+    *this = std::move(other);
+}
+
+Snapshot& Snapshot::operator=(Snapshot&& other) {
+    if(this == &other) {
+        return *this;
+    }
+
+    release();
+
+    root_ = std::move(other.root_);
+    scanned_ns_ = other.scanned_ns_;
+    entries_ = other.entries_;
+    count_ = other.count_;
+    names_ = other.names_;
+    names_size_ = other.names_size_;
+    owned_entries_ = std::move(other.owned_entries_);
+    owned_names_ = std::move(other.owned_names_);
+
+    other.entries_ = nullptr;
+    other.count_ = 0;
+    other.names_ = nullptr;
+    other.names_size_ = 0;
+
+    return *this;
+}
+
+Snapshot::~Snapshot() {
+    release();
+}
+
+void Snapshot::release() {
+    entries_ = nullptr;
+    count_ = 0;
+    names_ = nullptr;
+    names_size_ = 0;
+    owned_entries_.clear();
+    owned_names_.clear();
+}
+
+void Snapshot::adopt(std::vector<Entry>& entries, std::vector<char>& names) {
+    release();
+
+    owned_entries_.swap(entries);
+    owned_names_.swap(names);
+
+    entries_ = owned_entries_.data();
+    count_ = owned_entries_.size();
+    names_ = owned_names_.data();
+    names_size_ = owned_names_.size();
+}
+
+void Snapshot::save(const Path& file) const {
+    Header header;
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header.byte_order = SNAPSHOT_BYTE_ORDER;
+    header.entry_size = sizeof(Entry);
+    header.entry_count = count_;
+    header.names_size = names_size_;
+    header.root_size = root_.size();
+    header.scanned_ns = scanned_ns_;
+
+#ifdef KFS_POSIX
+    Path temp = temp_name_for(file);
+#else
+    Path temp = file + ".tmp";
+#endif
+
+    {
+        std::ofstream out(temp.c_str(), std::ios::binary | std::ios::trunc);
+        const char padding[8] = {0};
+
+        out.write((const char*) &header, sizeof(header));
+        out.write(root_.data(), root_.size());
+        out.write(padding, pad8(root_.size()) - root_.size());
+        out.write((const char*) entries_, count_ * sizeof(Entry));
+        out.write(names_, names_size_);
+
+        if(!out.flush()) {
+            kfs::remove(temp);
+            throw IOError("Unable to write snapshot");
+        }
+    }
+
+#ifdef KFS_POSIX
+    /* Don't publish the new file until it's on disk, or a crash could leave
+     * an empty or partial snapshot where the old one was */
+    try {
+        sync_path(temp);
+    } catch(...) {
+        kfs::remove(temp);
+        throw;
+    }
+
+    rename(temp, file);
+    sync_parent(file);
+#else
+    rename(temp, file);
+#endif
+}
+
+std::size_t Snapshot::refresh() {
+    std::vector<Entry> entries;
+    std::vector<char> names;
+    std::vector<uint32_t> previous;     /* The matching directory in this snapshot */
+    std::vector<char> fresh;            /* Whether the entry was just lstat'd */
+
+    uint64_t scanned_ns = now_ns();
+    std::size_t rescanned = 0;
+
+    Stat st;
+    if(!lstat_nofollow(root_, st)) {
+        throw IOError(errno);
+    }
+
+    entries.push_back(make_entry(st, NO_ENTRY, Path(), names));
+    previous.push_back((count_ && S_ISDIR(entries_[0].mode)) ? 0 : NO_ENTRY);
+    fresh.push_back(true);
+
+    auto old_name = [this](uint32_t i) -> Path {
+        return Path(names_ + entries_[i].name_offset, entries_[i].name_length);
+    };
+
+    /* Breadth first, so each directory's children are appended contiguously */
+    for(std::size_t i = 0; i < entries.size(); ++i) {
+        if(!S_ISDIR(entries[i].mode)) {
+            continue;
+        }
+
+        Path relative = entry_path(entries.data(), names.data(), i);
+        Path full = (relative.empty()) ? root_ : path::join(root_, relative);
+
+        if(!fresh[i]) {
+            if(!lstat_nofollow(full, st)) {
+                continue;
+            }
+
+            entries[i].ino = st.ino;
+            entries[i].size = st.size;
+            entries[i].mtime_ns = st.mtime_ns;
+            entries[i].mode = st.mode;
+
+            if(!S_ISDIR(st.mode)) {
+                continue;
+            }
+        }
+
+        uint32_t old = previous[i];
+        entries[i].first_child = entries.size();
+
+        bool unchanged = old != NO_ENTRY &&
+            entries_[old].ino == entries[i].ino &&
+            entries_[old].mtime_ns == entries[i].mtime_ns &&
+            entries_[old].mtime_ns + SNAPSHOT_RACY_NS < scanned_ns_;
+
+        if(unchanged) {
+            for(uint32_t c = 0; c < entries_[old].child_count; ++c) {
+                uint32_t child = entries_[old].first_child + c;
+
+                Entry entry = entries_[child];
+                entry.parent = i;
+                entry.first_child = 0;
+                entry.child_count = 0;
+                entry.name_offset = names.size();
+                names.insert(names.end(), names_ + entries_[child].name_offset,
+                    names_ + entries_[child].name_offset + entries_[child].name_length);
+
+                entries.push_back(entry);
+                previous.push_back((S_ISDIR(entry.mode)) ? child : NO_ENTRY);
+                fresh.push_back(false);
+            }
+        } else {
+            ++rescanned;
+
+            auto children = path::list_dir(full);
+            std::sort(children.begin(), children.end());
+
+            for(auto& name: children) {
+                if(!lstat_nofollow(path::join(full, name), st)) {
+                    /* Removed since we listed the directory */
+                    continue;
+                }
+
+                uint32_t match = NO_ENTRY;
+                if(old != NO_ENTRY && S_ISDIR(st.mode)) {
+                    uint32_t lo = entries_[old].first_child;
+                    uint32_t hi = lo + entries_[old].child_count;
+                    while(lo < hi) {
+                        uint32_t mid = lo + (hi - lo) / 2;
+                        if(old_name(mid) < name) {
+                            lo = mid + 1;
+                        } else {
+                            hi = mid;
+                        }
+                    }
+
+                    if(lo < entries_[old].first_child + entries_[old].child_count &&
+                        old_name(lo) == name && S_ISDIR(entries_[lo].mode)) {
+                        match = lo;
+                    }
+                }
+
+                entries.push_back(make_entry(st, i, name, names));
+                previous.push_back(match);
+                fresh.push_back(true);
+            }
+        }
+
+        entries[i].child_count = entries.size() - entries[i].first_child;
+    }
+
+    scanned_ns_ = scanned_ns;
+    adopt(entries, names);
+    return rescanned;
+}
+
+Path Snapshot::name(std::size_t i) const {
+    return Path(names_ + entries_[i].name_offset, entries_[i].name_length);
+}
+
+Path Snapshot::path(std::size_t i) const {
+    return entry_path(entries_, names_, i);
+}
+
+std::pair<std::size_t, bool> Snapshot::find(const Path& relative) const {
+    if(!count_) {
+        return std::make_pair(0, false);
+    }
+
+    std::size_t current = 0;
+    for(auto& part: str_split(relative, SEP)) {
+        if(part == ".") {
+            continue;
+        }
+
+        const Entry& dir = entries_[current];
+        const Entry* begin = entries_ + dir.first_child;
+        const Entry* end = begin + dir.child_count;
+
+        auto it = std::lower_bound(begin, end, part, [this](const Entry& e, const Path& n) {
+            return Path(names_ + e.name_offset, e.name_length) < n;
+        });
+
+        if(it == end || Path(names_ + it->name_offset, it->name_length) != part) {
+            return std::make_pair(0, false);
+        }
+
+        current = it - entries_;
+    }
+
+    return std::make_pair(current, true);
+}
+
+// ================================================================================================
+// Transactions
+// ================================================================================================
+
+/* Removes a file, link or whole directory tree */
+static void remove_tree(const Path& path) {
+    Stat st;
+    if(!lstat_nofollow(path, st)) {
+        return;
+    }
+
+    if(S_ISDIR(st.mode)) {
+        for(auto& name: path::list_dir(path)) {
+            remove_tree(path::join(path, name));
+        }
+        remove_dir(path);
+    } else if(::remove(path.c_str()) != 0) {
+        throw IOError(errno);
+    }
+}
+
+static Path aside_name_for(const Path& path) {
+#ifdef KFS_POSIX
+    return temp_name_for(path);
+#else
+    return path + ".kfs-old";
+#endif
+}
+
+void Transaction::rename(const Path& old, const Path& new_path) {
+    Operation op = {OPERATION_RENAME, old, new_path};
+    operations_.push_back(op);
+}
+
+void Transaction::exchange(const Path& a, const Path& b) {
+    Operation op = {OPERATION_EXCHANGE, a, b};
+    operations_.push_back(op);
+}
+
+void Transaction::remove(const Path& path) {
+    Operation op = {OPERATION_REMOVE, path, Path()};
+    operations_.push_back(op);
+}
+
+void Transaction::commit() {
+    std::vector<std::function<void ()>> undo;
+    std::vector<Path> trash;
+
+    try {
+        for(auto& op: operations_) {
+            const Path first = op.first;
+            const Path second = op.second;
+
+            switch(op.type) {
+                case OPERATION_RENAME: {
+                    Stat st;
+                    if(!lstat_nofollow(second, st)) {
+                        rename_noreplace(first, second);
+                        undo.push_back([=]() { kfs::rename(second, first); });
+                        break;
+                    }
+
+                    /* Keep the replaced target until we know we've succeeded.
+                     * Swapping first means second never goes missing */
+                    Path aside = aside_name_for(second);
+
+                    bool swapped = false;
+                    try {
+                        kfs::exchange(first, second);
+                        swapped = true;
+                    } catch(std::logic_error&) {
+                        /* Not supported on this platform */
+                    } catch(IOError& e) {
+                        if(e.err != EINVAL && e.err != ENOSYS && e.err != ENOTSUP) {
+                            throw;
+                        }
+                    }
+
+                    if(swapped) {
+                        try {
+                            kfs::rename(first, aside);
+                        } catch(...) {
+                            kfs::exchange(first, second);
+                            throw;
+                        }
+
+                        undo.push_back([=]() {
+                            kfs::rename(aside, first);
+                            kfs::exchange(first, second);
+                        });
+                    } else {
+                        kfs::rename(second, aside);
+                        try {
+                            kfs::rename(first, second);
+                        } catch(...) {
+                            kfs::rename(aside, second);
+                            throw;
+                        }
+
+                        undo.push_back([=]() {
+                            kfs::rename(second, first);
+                            kfs::rename(aside, second);
+                        });
+                    }
+                    trash.push_back(aside);
+                } break;
+                case OPERATION_EXCHANGE:
+                    kfs::exchange(first, second);
+                    undo.push_back([=]() { kfs::exchange(first, second); });
+                break;
+                case OPERATION_REMOVE: {
+                    Path aside = aside_name_for(first);
+                    kfs::rename(first, aside);
+                    undo.push_back([=]() { kfs::rename(aside, first); });
+                    trash.push_back(aside);
+                } break;
+            }
+        }
+    } catch(...) {
+        for(auto it = undo.rbegin(); it != undo.rend(); ++it) {
+            try {
+                (*it)();
+            } catch(...) {
+                /* Carry on and restore as much as we can */
+            }
+        }
+
+        operations_.clear();
+        throw;
+    }
+
+    operations_.clear();
+
+    for(auto& path: trash) {
+        remove_tree(path);
+    }
+}
+
+// ================================================================================================
+// Deferred removal
+// ================================================================================================
+
+static const char* GRAVEYARD_NAME = ".kfs-graveyard";
+
+/* Graveyards given to set_deferred_removal_graveyard(), by device */
+static std::mutex graveyards_mutex;
+static std::unordered_map<uint64_t, Path> graveyards;
+
+static bool configured_graveyard(const Path& graveyard) {
+    std::lock_guard<std::mutex> lock(graveyards_mutex);
+    for(auto& entry: graveyards) {
+        if(entry.second == graveyard) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Deletes trees that have been moved into a graveyard, on its own thread */
+class Reaper {
+public:
+    ~Reaper() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        cond_.notify_all();
+
+        if(thread_.joinable()) {
+            thread_.join();
+        }
+    }
+
+    void push(const Path& path) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        queue_.push_back(path);
+
+        if(!thread_.joinable()) {
+            thread_ = std::thread(&Reaper::run, this);
+        }
+
+        cond_.notify_all();
+    }
+
+    IoBudget& budget() {
+        return budget_;
+    }
+
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        idle_.wait(lock, [this]() { return queue_.empty() && !busy_; });
+    }
+
+private:
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex_);
+
+        for(;;) {
+            cond_.wait(lock, [this]() { return stopping_ || !queue_.empty(); });
+            if(stopping_) {
+                return;
+            }
+
+            Path path = queue_.front();
+            queue_.erase(queue_.begin());
+            busy_ = true;
+            lock.unlock();
+
+            try {
+                ScopedIoPriority priority(&budget_);
+                reap(path);
+
+                /* Graveyards alongside removed directories are tidied away
+                 * once empty, rmdir leaves them if they aren't */
+                Path graveyard = path::dir_name(path);
+                if(!configured_graveyard(graveyard)) {
+                    ::rmdir(graveyard.c_str());
+                }
+            } catch(...) {
+                /* Whatever is left gets another go on the next resume */
+            }
+
+            lock.lock();
+            busy_ = false;
+            idle_.notify_all();
+        }
+    }
+
+    void throttle() {
+        budget_.acquire(1);
+    }
+
+    bool stopped() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return stopping_;
+    }
+
+    void reap(const Path& path) {
+#ifdef KFS_POSIX
+        Stat st;
+        if(!lstat_nofollow(path, st)) {
+            return;
+        }
+
+        if(S_ISDIR(st.mode)) {
+            std::vector<Path> dirs;
+            {
+                DirReader reader(path);
+                while(reader.next()) {
+                    if(stopped()) {
+                        return;
+                    }
+
+                    if(reader.type() == ENTRY_TYPE_DIR || reader.type() == ENTRY_TYPE_UNKNOWN) {
+                        dirs.push_back(reader.name());
+                        continue;
+                    }
+
+                    throttle();
+                    ::unlinkat(reader.fd(), reader.name(), 0);
+                }
+            }
+
+            for(auto& dir: dirs) {
+                reap(path::join(path, dir));
+            }
+
+            if(stopped()) {
+                return;
+            }
+
+            throttle();
+            ::rmdir(path.c_str());
+        } else {
+            throttle();
+            ::unlink(path.c_str());
+        }
+#else
+        remove_tree(path);
+#endif
+    }
+
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::condition_variable idle_;
+    std::vector<Path> queue_;
+    std::thread thread_;
+    bool stopping_ = false;
+    bool busy_ = false;
+
+    IoBudget budget_;
+};
+
+static Reaper& reaper() {
+    static Reaper reaper;
+    return reaper;
+}
+
+/* The graveyard to move path into: the one set for its filesystem if there
+ * is one, otherwise one alongside path, which is on the same filesystem
+ * without anything being written further up the tree. Returns an empty
+ * path if there's no graveyard we can use */
+static Path graveyard_for(const Path& path, bool create) {
+    Path parent = path::dir_name(path::abs_path(path));
+
+    Stat st;
+    if(!lstat_nofollow(parent, st)) {
+        throw IOError(errno);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(graveyards_mutex);
+        auto it = graveyards.find(st.dev);
+        if(it != graveyards.end()) {
+            return it->second;
+        }
+    }
+
+    Path graveyard = (parent == Path(1, SEP)) ? Path(1, SEP) + GRAVEYARD_NAME : path::join(parent, GRAVEYARD_NAME);
+
+#ifdef KFS_POSIX
+    if(create && ::mkdir(graveyard.c_str(), 0700) != 0 && errno != EEXIST) {
+        return Path();
+    }
+
+    /* Not one left by another user, or something else with the same name */
+    Stat graveyard_st;
+    if(!lstat_nofollow(graveyard, graveyard_st) || !S_ISDIR(graveyard_st.mode) || graveyard_st.uid != ::geteuid()) {
+        return Path();
+    }
+#else
+    if(!path::is_dir(graveyard)) {
+        if(!create) {
+            return Path();
+        }
+
+        try {
+            make_dir(graveyard);
+        } catch(IOError&) {
+            return Path();
+        }
+    }
+#endif
+
+    return graveyard;
+}
+
+void remove_dirs_deferred(const Path& path) {
+    if(!kfs::path::exists(path)) {
+        throw IOError("Tried to remove a non-existent path");
+    }
+
+    /* Only a real directory gets swapped for an empty one. A symlink would
+     * be replaced by a directory and a file by something that can't be
+     * entered */
+#ifdef KFS_POSIX
+    Stat st;
+    if(!lstat_nofollow(path, st)) {
+        throw IOError(errno);
+    } else if(!S_ISDIR(st.mode)) {
+        throw IOError(ENOTDIR);
+    }
+#else
+    if(!path::is_dir(path)) {
+        throw IOError("Path was not a directory");
+    }
+    Stat st = kfs::lstat(path).first;
+#endif
+
+    Path graveyard = graveyard_for(path, true);
+    if(graveyard.empty()) {
+        remove_dirs(path);
+        return;
+    }
+
+    Path target = path::join(
+        graveyard,
+#ifdef KFS_POSIX
+        std::to_string(::getpid()) + "-" + std::to_string(temp_counter++) + "-" + path::split(path).second
+#else
+        std::to_string(temp_counter++) + "-" + path::split(path).second
+#endif
+    );
+
+    try {
+        rename(path, target);
+    } catch(IOError& e) {
+        /* A bind mount of the same filesystem (which can't be moved out of),
+         * a graveyard we aren't allowed into, or one that was reaped just as
+         * we got to it. All that's left is removing in place */
+        if(e.err != EXDEV && e.err != EACCES && e.err != EPERM && e.err != ENOENT) {
+            throw;
+        }
+
+        remove_dirs(path);
+        return;
+    }
+
+    make_dir(path, st.mode & 07777);
+
+#ifdef KFS_POSIX
+    /* Put back what the umask and creating it as us changed. Only root can
+     * give it to someone else, anyone else gets to keep it */
+    if(::chmod(path.c_str(), st.mode & 07777) != 0) {
+        throw IOError(errno);
+    }
+
+    if((st.uid != ::geteuid() || st.gid != ::getegid()) &&
+        ::chown(path.c_str(), st.uid, st.gid) != 0 && errno != EPERM) {
+        throw IOError(errno);
+    }
+#endif
+
+    reaper().push(target);
+}
+
+void resume_deferred_removals(const Path& path) {
+    Path graveyard = graveyard_for(path::join(path, GRAVEYARD_NAME), false);
+    if(graveyard.empty()) {
+        return;
+    }
+
+    for(auto& name: path::list_dir(graveyard)) {
+        reaper().push(path::join(graveyard, name));
+    }
+}
+
+void set_deferred_removal_graveyard(const Path& graveyard) {
+    Path dir = path::abs_path(graveyard);
+    if(!path::is_dir(dir)) {
+        make_dirs(dir, 0700);
+    }
+
+    Stat st;
+    if(!lstat_nofollow(dir, st)) {
+        throw IOError(errno);
+    }
+
+    std::lock_guard<std::mutex> lock(graveyards_mutex);
+    graveyards[st.dev] = dir;
+}
+
+void set_deferred_removal_rate(uint32_t removals_per_second) {
+    reaper().budget().set_ops_per_second(removals_per_second);
+}
+
+IoBudget& deferred_removal_budget() {
+    return reaper().budget();
+}
+
+void wait_for_deferred_removals() {
+    reaper().wait();
+}
+
+// ================================================================================================
+// Memory mapped writing
+// ================================================================================================
+
+const std::size_t MappedWriter::DEFAULT_RESERVE;
+const std::size_t MappedWriter::DEFAULT_CHUNK;
+
+#ifdef KFS_POSIX
+/* Grows the file to size if it's shorter, never shrinking it */
+static int extend_to(int fd, off_t size) {
+    struct stat st;
+    if(::fstat(fd, &st) != 0) {
+        return errno;
+    }
+
+    if(st.st_size < size && ::ftruncate(fd, size) != 0) {
+        return errno;
+    }
+    return 0;
+}
+
+/* Reserves disk space for [offset, offset + length), extending the file if
+ * it's shorter. Returns EOPNOTSUPP when the space can't be reserved */
+static int preallocate(int fd, off_t offset, off_t length) {
+#ifdef __linux__
+    if(::fallocate(fd, 0, offset, length) == 0) {
+        return 0;
+    } else if(errno != EOPNOTSUPP && errno != ENOSYS) {
+        return errno;
+    }
+#endif
+
+#if defined(__APPLE__)
+    struct stat st;
+    if(::fstat(fd, &st) != 0) {
+        return errno;
+    }
+
+    /* F_PREALLOCATE works from the end of what's allocated, so only ask for
+     * what lies past the current end of the file */
+    off_t end = offset + length;
+    if(end > st.st_size) {
+        fstore_t store = {F_ALLOCATECONTIG, F_PEOFPOSMODE, 0, end - st.st_size, 0};
+        if(::fcntl(fd, F_PREALLOCATE, &store) != 0) {
+            store.fst_flags = F_ALLOCATEALL;
+            if(::fcntl(fd, F_PREALLOCATE, &store) != 0) {
+                return (errno == ENOTSUP || errno == EINVAL) ? EOPNOTSUPP : errno;
+            }
+        }
+    }
+    return extend_to(fd, end);
+#else
+    int ret = ::posix_fallocate(fd, offset, length);
+    return (ret == EINVAL) ? EOPNOTSUPP : ret;
+#endif
+}
+
+static std::size_t round_up(std::size_t value, std::size_t multiple) {
+    return ((value + multiple - 1) / multiple) * multiple;
+}
+
+static char* reserve_address_space(std::size_t size) {
+    void* addr = ::mmap(nullptr, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(addr == MAP_FAILED) {
+        throw IOError(errno);
+    }
+    return (char*) addr;
+}
+#endif
+
+MappedWriter::MappedWriter(const Path& path, std::size_t reserve, std::size_t chunk) {
+#ifdef KFS_POSIX
+    page_size_ = ::sysconf(_SC_PAGESIZE);
+    chunk_ = round_up(std::max<std::size_t>(chunk, 1), page_size_);
+
+    fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if(fd_ < 0) {
+        throw IOError(errno);
+    }
+
+    try {
+        struct ::stat st;
+        if(::fstat(fd_, &st) != 0) {
+            throw IOError(errno);
+        }
+
+        reserve_ = round_up(std::max<std::size_t>(reserve, st.st_size + chunk_), page_size_);
+        base_ = reserve_address_space(reserve_);
+
+        grow(st.st_size);
+        size_ = st.st_size;
+    } catch(...) {
+        close();
+        throw;
+    }
+#else
+    (void) (path);
+    (void) (reserve);
+    (void) (chunk);
+    throw std::logic_error("Not implemented");
+#endif
+}
+
+MappedWriter::~MappedWriter() {
+    try {
+        close();
+    } catch(...) {
+
+    }
+}
+
+void MappedWriter::grow(std::size_t needed) {
+#ifdef KFS_POSIX
+    std::size_t new_capacity = round_up(needed, chunk_);
+    if(new_capacity <= capacity_) {
+        return;
+    }
+
+    int err = preallocate(fd_, capacity_, new_capacity - capacity_);
+    if(err == EOPNOTSUPP) {
+        /* The mapping only needs the file to be long enough, so where space
+         * can't be reserved a sparse file will have to do */
+        err = extend_to(fd_, new_capacity);
+    }
+
+    if(err) {
+        throw IOError(err);
+    }
+
+    if(new_capacity > reserve_) {
+        std::size_t new_reserve = round_up(std::max(reserve_ * 2, new_capacity), page_size_);
+        char* new_base = reserve_address_space(new_reserve);
+
+        if(capacity_) {
+#ifdef __linux__
+            /* Move what's mapped so far to the start of the new reservation */
+            void* moved = ::mremap(base_, capacity_, capacity_, MREMAP_MAYMOVE | MREMAP_FIXED, new_base);
+            if(moved == MAP_FAILED) {
+                err = errno;
+                ::munmap(new_base, new_reserve);
+                throw IOError(err);
+            }
+#else
+            void* mapped = ::mmap(new_base, capacity_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd_, 0);
+            if(mapped == MAP_FAILED) {
+                err = errno;
+                ::munmap(new_base, new_reserve);
+                throw IOError(err);
+            }
+#endif
+        }
+
+        ::munmap(base_, reserve_);
+        base_ = new_base;
+        reserve_ = new_reserve;
+    }
+
+    void* mapped = ::mmap(
+        base_ + capacity_, new_capacity - capacity_,
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+        fd_, capacity_
+    );
+
+    if(mapped == MAP_FAILED) {
+        throw IOError(errno);
+    }
+
+    capacity_ = new_capacity;
+#else
+    (void) (needed);
+#endif
+}
+
+char* MappedWriter::append(std::size_t length) {
+    std::size_t offset = size_;
+    resize(size_ + length);
+    return base_ + offset;
+}
+
+void MappedWriter::resize(std::size_t size) {
+    if(fd_ < 0) {
+        throw IOError(EBADF);
+    }
+
+    grow(size);
+    size_ = size;
+}
+
+void MappedWriter::flush(std::size_t offset, std::size_t length, bool async) {
+#ifdef KFS_POSIX
+    if(!length) {
+        return;
+    }
+
+    std::size_t start = offset - (offset % page_size_);
+    if(::msync(base_ + start, length + (offset - start), (async) ? MS_ASYNC : MS_SYNC) != 0) {
+        throw IOError(errno);
+    }
+#else
+    (void) (offset);
+    (void) (length);
+    (void) (async);
+#endif
+}
+
+void MappedWriter::close() {
+#ifdef KFS_POSIX
+    if(base_) {
+        ::munmap(base_, reserve_);
+        base_ = nullptr;
+    }
+
+    if(fd_ >= 0) {
+        int err = (::ftruncate(fd_, size_) == 0) ? 0 : errno;
+        ::close(fd_);
+        fd_ = -1;
+        capacity_ = 0;
+
+        if(err) {
+            throw IOError(err);
+        }
+    }
+#endif
+}
+
+// ================================================================================================
+// Content cache
+// ================================================================================================
+
+/* Reads a whole file along with the stat of what was actually read */
+static void read_with_stat(const Path& path, std::string& out, Stat& st) {
+#ifdef KFS_POSIX
+    ScopedFD fd(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    if(fd.get() < 0) {
+        throw IOError(errno);
+    }
+
+    struct ::stat result;
+    if(::fstat(fd.get(), &result) != 0) {
+        throw IOError(errno);
+    }
+    fill_stat(result, st);
+
+    out.resize(st.size);
+    std::size_t done = 0;
+    for(;;) {
+        if(done == out.size()) {
+            /* The file may have grown since the fstat */
+            out.resize(done + 16 * 1024);
+        }
+
+        ssize_t n = ::read(fd.get(), &out[done], out.size() - done);
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            throw IOError(errno);
+        } else if(n == 0) {
+            break;
+        }
+        done += n;
+    }
+    out.resize(done);
+#else
+    auto result = lstat(path);
+    if(!result.second) {
+        throw IOError("Unable to read file: " + path);
+    }
+    st = result.first;
+    out = path::read_file_contents(path);
+#endif
+}
+
+ContentCache::ContentCache(std::size_t max_bytes, std::chrono::milliseconds revalidate_interval, uint32_t shards):
+    interval_(revalidate_interval) {
+
+    shards = std::max<uint32_t>(shards, 1);
+    shard_bytes_ = max_bytes / shards;
+
+    for(uint32_t i = 0; i < shards; ++i) {
+        shards_.emplace_back(new Shard());
+    }
+}
+
+ContentCache::Shard& ContentCache::shard_for(const Path& path) {
+    return *shards_[std::hash<Path>()(path) % shards_.size()];
+}
+
+/* Must be called with the shard locked */
+void ContentCache::insert(Shard& shard, Entry entry) {
+    auto it = shard.index.find(entry.path);
+    if(it != shard.index.end()) {
+        shard.bytes -= it->second->data->size();
+        shard.lru.erase(it->second);
+        shard.index.erase(it);
+    }
+
+    std::size_t size = entry.data->size();
+    if(size > shard_bytes_) {
+        return;
+    }
+
+    while(shard.bytes + size > shard_bytes_ && !shard.lru.empty()) {
+        auto& victim = shard.lru.back();
+        shard.bytes -= victim.data->size();
+        shard.index.erase(victim.path);
+        shard.lru.pop_back();
+    }
+
+    shard.lru.push_front(std::move(entry));
+    shard.index[shard.lru.front().path] = shard.lru.begin();
+    shard.bytes += size;
+}
+
+ContentCache::Buffer ContentCache::get(const Path& path) {
+    Shard& shard = shard_for(path);
+    auto now = std::chrono::steady_clock::now();
+
+    Entry cached;
+    bool found = false;
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.index.find(path);
+        if(it != shard.index.end()) {
+            shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+            if(now - it->second->checked < interval_) {
+                ++hits_;
+                return it->second->data;
+            }
+
+            cached = *it->second;
+            found = true;
+        }
+    }
+
+    /* Stale or missing, the stat and read happen without the lock held */
+    if(found) {
+        auto st = lstat(path);
+        if(st.second && st.first.ino == cached.ino && st.first.size == cached.size &&
+            st.first.mtime_ns == cached.mtime_ns) {
+
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            auto it = shard.index.find(path);
+            if(it != shard.index.end() && it->second->data == cached.data) {
+                it->second->checked = now;
+            }
+
+            ++hits_;
+            return cached.data;
+        }
+    }
+
+    ++misses_;
+
+    std::string contents;
+    Stat st;
+    try {
+        read_with_stat(path, contents, st);
+    } catch(IOError&) {
+        invalidate(path);
+        throw;
+    }
+
+    Entry entry;
+    entry.path = path;
+    entry.data = std::make_shared<const std::string>(std::move(contents));
+    entry.ino = st.ino;
+    entry.size = st.size;
+    entry.mtime_ns = st.mtime_ns;
+    entry.checked = now;
+
+    Buffer data = entry.data;
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        insert(shard, std::move(entry));
+    }
+    return data;
+}
+
+void ContentCache::invalidate(const Path& path) {
+    Shard& shard = shard_for(path);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+
+    auto it = shard.index.find(path);
+    if(it != shard.index.end()) {
+        shard.bytes -= it->second->data->size();
+        shard.lru.erase(it->second);
+        shard.index.erase(it);
+    }
+}
+
+void ContentCache::clear() {
+    for(auto& shard: shards_) {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        shard->index.clear();
+        shard->lru.clear();
+        shard->bytes = 0;
+    }
+}
+
+std::size_t ContentCache::bytes_held() const {
+    std::size_t total = 0;
+    for(auto& shard: shards_) {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        total += shard->bytes;
+    }
+    return total;
+}
+
+std::size_t ContentCache::entry_count() const {
+    std::size_t total = 0;
+    for(auto& shard: shards_) {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        total += shard->lru.size();
+    }
+    return total;
+}
+
+double ContentCache::hit_ratio() const {
+    uint64_t hits = hits_;
+    uint64_t total = hits + misses_;
+    return (total) ? double(hits) / total : 0.0;
+}
+
+// ================================================================================================
+// Parallel reads
+// ================================================================================================
+
+#ifdef KFS_POSIX
+#ifndef POSIX_FADV_NORMAL
+/* No posix_fadvise (e.g. OSX), hints are ignored */
+#define POSIX_FADV_WILLNEED 0
+#define POSIX_FADV_DONTNEED 0
+#define POSIX_FADV_SEQUENTIAL 0
+#endif
+
+static void advise(int fd, off_t offset, off_t length, int advice) {
+#ifdef POSIX_FADV_NORMAL
+    ::posix_fadvise(fd, offset, length, advice);
+#else
+    (void) (fd);
+    (void) (offset);
+    (void) (length);
+    (void) (advice);
+#endif
+}
+
+/* preads the whole of [offset, offset + length), returning fewer bytes
+ * only at the end of the file */
+static std::size_t pread_full(int fd, char* out, std::size_t length, off_t offset) {
+    std::size_t done = 0;
+    while(done < length) {
+        ssize_t n = ::pread(fd, out + done, length - done, offset + done);
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            throw IOError(errno);
+        } else if(n == 0) {
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
+
+static std::size_t read_chunks(int fd, char* buffer, std::size_t length, const ReadOptions& options) {
+    std::size_t page = ::sysconf(_SC_PAGESIZE);
+    std::size_t chunk = round_up(std::max<std::size_t>(options.chunk_size, 1), page);
+    std::size_t count = (length + chunk - 1) / chunk;
+
+    if(options.will_need) {
+        advise(fd, 0, length, POSIX_FADV_WILLNEED);
+    }
+
+    /* A chunk that comes up short means the file shrank underneath us, only
+     * what's before the first short chunk is trustworthy */
+    std::atomic<std::size_t> read_to(length);
+    parallel_for(count, options.threads, [&](std::size_t i) {
+        std::size_t offset = i * chunk;
+        std::size_t wanted = std::min(chunk, length - offset);
+
+        charge(options.budget, 1, wanted);
+        std::size_t got = pread_full(fd, buffer + offset, wanted, offset);
+        if(got < wanted) {
+            std::size_t end = offset + got;
+            std::size_t current = read_to;
+            while(end < current && !read_to.compare_exchange_weak(current, end)) {}
+        }
+    }, options.budget);
+
+    if(options.drop_cache) {
+        advise(fd, 0, length, POSIX_FADV_DONTNEED);
+    }
+
+    return read_to;
+}
+#endif
+
+ReadStats read_file_parallel(const Path& path, char* buffer, std::size_t capacity, const ReadOptions& options) {
+    ReadStats stats;
+    auto start = std::chrono::steady_clock::now();
+
+#ifdef KFS_POSIX
+    ScopedFD fd(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    if(fd.get() < 0) {
+        throw IOError(errno);
+    }
+
+    struct ::stat st;
+    if(::fstat(fd.get(), &st) != 0) {
+        throw IOError(errno);
+    }
+
+    std::size_t length = std::min<std::size_t>(st.st_size, capacity);
+    stats.bytes = read_chunks(fd.get(), buffer, length, options);
+#else
+    (void) (options);
+    std::ifstream file(path.c_str(), std::ios::binary);
+    if(!file) {
+        throw IOError("Unable to open file: " + path);
+    }
+    file.read(buffer, capacity);
+    stats.bytes = file.gcount();
+#endif
+
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return stats;
+}
+
+ReadStats read_file_parallel(const Path& path, std::string& buffer, const ReadOptions& options) {
+#ifdef KFS_POSIX
+    ReadStats stats;
+    auto start = std::chrono::steady_clock::now();
+
+    ScopedFD fd(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    if(fd.get() < 0) {
+        throw IOError(errno);
+    }
+
+    struct ::stat st;
+    if(::fstat(fd.get(), &st) != 0) {
+        throw IOError(errno);
+    }
+
+    buffer.resize(st.st_size);
+    stats.bytes = read_chunks(fd.get(), &buffer[0], buffer.size(), options);
+    buffer.resize(stats.bytes);
+
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return stats;
+#else
+    auto result = lstat(path);
+    if(!result.second) {
+        throw IOError("Unable to open file: " + path);
+    }
+
+    buffer.resize(result.first.size);
+    ReadStats stats = read_file_parallel(path, &buffer[0], buffer.size(), options);
+    buffer.resize(stats.bytes);
+    return stats;
+#endif
+}
+
+// ================================================================================================
+// Page cache hints
+// ================================================================================================
+
+static PrefetchStats advise_files(const std::vector<Path>& paths, const PrefetchOptions& options, bool will_need) {
+    std::atomic<uint64_t> files(0);
+    std::atomic<uint64_t> bytes(0);
+    std::atomic<uint64_t> failed(0);
+
+#ifdef KFS_POSIX
+    parallel_for(paths.size(), options.threads, [&](std::size_t i) {
+        if(options.max_bytes && bytes >= options.max_bytes) {
+            return;
+        }
+
+        charge(options.budget, 1);
+
+        ScopedFD fd(::open(paths[i].c_str(), O_RDONLY | O_CLOEXEC));
+        struct ::stat st;
+        if(fd.get() < 0 || ::fstat(fd.get(), &st) != 0 || !S_ISREG(st.st_mode)) {
+            ++failed;
+            return;
+        }
+
+        /* Claim our share of what's left of the byte limit */
+        uint64_t length = st.st_size;
+        if(options.max_bytes) {
+            uint64_t current = bytes;
+            do {
+                if(current >= options.max_bytes) {
+                    return;
+                }
+                length = std::min<uint64_t>(st.st_size, options.max_bytes - current);
+            } while(!bytes.compare_exchange_weak(current, current + length));
+        } else {
+            bytes += length;
+        }
+
+        if(will_need) {
+            charge(options.budget, 0, length);
+#ifdef __linux__
+            ::readahead(fd.get(), 0, length);
+#else
+            advise(fd.get(), 0, length, POSIX_FADV_WILLNEED);
+#endif
+        } else {
+            advise(fd.get(), 0, length, POSIX_FADV_DONTNEED);
+        }
+
+        ++files;
+    }, options.budget);
+#else
+    (void) (paths);
+    (void) (options);
+    (void) (will_need);
+#endif
+
+    PrefetchStats stats;
+    stats.files = files;
+    stats.bytes = bytes;
+    stats.failed = failed;
+    return stats;
+}
+
+static std::vector<Path> files_under(const Path& root, const PrefetchOptions& options) {
+    std::vector<Path> paths;
+    for(auto& entry: find(root, Query().type(ENTRY_TYPE_FILE).threads(options.threads).budget(options.budget))) {
+        paths.push_back(std::move(entry.path));
+    }
+    return paths;
+}
+
+PrefetchStats prefetch(const std::vector<Path>& paths, const PrefetchOptions& options) {
+    return advise_files(paths, options, true);
+}
+
+PrefetchStats prefetch(const Path& root, const PrefetchOptions& options) {
+    return advise_files(files_under(root, options), options, true);
+}
+
+PrefetchStats evict(const std::vector<Path>& paths, const PrefetchOptions& options) {
+    return advise_files(paths, options, false);
+}
+
+PrefetchStats evict(const Path& root, const PrefetchOptions& options) {
+    return advise_files(files_under(root, options), options, false);
+}
+
+// ================================================================================================
+// Bulk loading
+// ================================================================================================
+
+std::vector<LoadedFile> load_files(const std::vector<Path>& paths, std::vector<char>& arena,
+                                   uint32_t threads, IoBudget* budget) {
+    std::vector<LoadedFile> files(paths.size());
+    std::vector<std::size_t> offsets(paths.size() + 1, 0);
+
+#ifdef KFS_POSIX
+    parallel_for(paths.size(), threads, [&](std::size_t i) {
+        charge(budget, 1);
+
+        files[i].path = paths[i];
+
+        struct ::stat st;
+        if(::stat(paths[i].c_str(), &st) != 0) {
+            files[i].error = errno;
+        } else if(S_ISDIR(st.st_mode)) {
+            files[i].error = EISDIR;
+        } else {
+            files[i].size = st.st_size;
+        }
+    }, budget);
+
+    for(std::size_t i = 0; i < files.size(); ++i) {
+        offsets[i + 1] = offsets[i] + files[i].size;
+    }
+
+    arena.clear();
+    arena.resize(offsets.back());
+
+    parallel_for(paths.size(), threads, [&](std::size_t i) {
+        LoadedFile& file = files[i];
+        if(file.error) {
+            file.size = 0;
+            return;
+        }
+
+        char* slot = arena.data() + offsets[i];
+        std::size_t capacity = offsets[i + 1] - offsets[i];
+        file.data = slot;
+
+        charge(budget, 1, capacity);
+
+        ScopedFD fd(::open(file.path.c_str(), O_RDONLY | O_CLOEXEC));
+        struct ::stat st;
+        if(fd.get() < 0 || ::fstat(fd.get(), &st) != 0) {
+            file.error = errno;
+        } else if(std::size_t(st.st_size) > capacity) {
+            file.error = EAGAIN;
+        } else {
+            try {
+                file.size = pread_full(fd.get(), slot, capacity, 0);
+                return;
+            } catch(IOError& e) {
+                file.error = (e.err) ? e.err : EIO;
+            }
+        }
+
+        file.data = nullptr;
+        file.size = 0;
+    }, budget);
+#else
+    for(std::size_t i = 0; i < paths.size(); ++i) {
+        files[i].path = paths[i];
+        auto st = lstat(paths[i]);
+        if(!st.second) {
+            files[i].error = ENOENT;
+        } else {
+            files[i].size = st.first.size;
+        }
+        offsets[i + 1] = offsets[i] + files[i].size;
+    }
+
+    arena.clear();
+    arena.resize(offsets.back());
+
+    for(std::size_t i = 0; i < paths.size(); ++i) {
+        if(!files[i].error) {
+            std::ifstream in(paths[i].c_str(), std::ios::binary);
+            in.read(arena.data() + offsets[i], files[i].size);
+            files[i].data = arena.data() + offsets[i];
+            files[i].size = in.gcount();
+        }
+    }
+    (void) (threads);
+    (void) (budget);
+#endif
+
+    return files;
+}
+
+// ================================================================================================
+// Watching
+// ================================================================================================
+
+#ifdef __linux__
+static const uint32_t WATCH_MASK =
+    IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB |
+    IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK;
+
+static void close_pipe(int fds[2]) {
+    for(int i = 0; i < 2; ++i) {
+        if(fds[i] >= 0) {
+            ::close(fds[i]);
+            fds[i] = -1;
+        }
+    }
+}
+
+static void drain_fd(int fd) {
+    char buffer[256];
+    while(::read(fd, buffer, sizeof(buffer)) > 0) {}
+}
+#endif
+
+Watcher::Watcher(const Path& root, std::chrono::milliseconds debounce, Callback callback, std::chrono::milliseconds max_latency):
+    root_(root),
+    debounce_(debounce),
+    callback_(callback),
+    max_latency_(max_latency) {
+
+#ifdef __linux__
+    inotify_fd_ = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(inotify_fd_ < 0) {
+        throw IOError(errno);
+    }
+
+    if(::pipe2(pipe_, O_NONBLOCK | O_CLOEXEC) != 0 || ::pipe2(wake_, O_NONBLOCK | O_CLOEXEC) != 0) {
+        int err = errno;
+        close_pipe(pipe_);
+        ::close(inotify_fd_);
+        throw IOError(err);
+    }
+
+    int wd = ::inotify_add_watch(inotify_fd_, root_.c_str(), WATCH_MASK);
+    if(wd < 0) {
+        int err = errno;
+        close_pipe(pipe_);
+        close_pipe(wake_);
+        ::close(inotify_fd_);
+        throw IOError(err);
+    }
+
+    watches_[wd] = root_;
+    drained_ns_ = now_ns();
+    add_watches(root_, false);
+    watch_count_ = watches_.size();
+
+    thread_ = std::thread(&Watcher::run, this);
+#else
+    throw std::logic_error("Not implemented");
+#endif
+}
+
+Watcher::~Watcher() {
+#ifdef __linux__
+    stopping_ = true;
+    if(::write(wake_[1], "x", 1) < 0) {
+        /* The pipe's full, so the thread's going to wake up anyway */
+    }
+
+    if(thread_.joinable()) {
+        thread_.join();
+    }
+
+    close_pipe(pipe_);
+    close_pipe(wake_);
+    ::close(inotify_fd_);
+#endif
+}
+
+/* Watches every directory under dir, which is already watched. If report is
+ * set anything found is recorded as created, as it may have been created
+ * before the watch on its directory existed */
+void Watcher::add_watches(const Path& dir, bool report) {
+#ifdef __linux__
+    std::vector<Path> dirs(1, dir);
+    while(!dirs.empty()) {
+        Path current = std::move(dirs.back());
+        dirs.pop_back();
+
+        std::unique_ptr<DirReader> reader;
+        try {
+            reader.reset(new DirReader(current));
+        } catch(IOError&) {
+            /* Gone already, its parent's watch will report it */
+            continue;
+        }
+
+        while(reader->next()) {
+            Path child = path::join(current, reader->name());
+
+            EntryType type = reader->type();
+            if(type == ENTRY_TYPE_UNKNOWN) {
+                struct ::stat st;
+                if(::fstatat(reader->fd(), reader->name(), &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                    continue;
+                }
+                type = entry_type_from_mode(st.st_mode);
+            }
+
+            if(report) {
+                record(child, WATCH_EVENT_CREATED, type == ENTRY_TYPE_DIR);
+            }
+
+            if(type != ENTRY_TYPE_DIR) {
+                continue;
+            }
+
+            int wd = ::inotify_add_watch(inotify_fd_, child.c_str(), WATCH_MASK);
+            if(wd >= 0) {
+                watches_[wd] = child;
+                dirs.push_back(child);
+            }
+        }
+    }
+
+    watch_count_ = watches_.size();
+#else
+    (void) (dir);
+    (void) (report);
+#endif
+}
+
+/* Drops the watches on dir and everything under it, after it's been moved.
+ * If it was moved within the tree, the new name gets fresh watches */
+void Watcher::remove_watches(const Path& dir) {
+#ifdef __linux__
+    Path prefix = dir + SEP;
+    for(auto it = watches_.begin(); it != watches_.end();) {
+        if(it->second == dir || it->second.compare(0, prefix.size(), prefix) == 0) {
+            ::inotify_rm_watch(inotify_fd_, it->first);
+            it = watches_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    watch_count_ = watches_.size();
+#else
+    (void) (dir);
+#endif
+}
+
+/* After the kernel queue overflowed: walks the tree, watching any
+ * directories that were missed, and reports everything changed since the
+ * queue was last emptied. Files only show that they were modified, and
+ * directories that their entries may have changed, which is as much as a
+ * walk can tell without remembering the whole tree */
+void Watcher::rescan(uint64_t since_ns) {
+#ifdef __linux__
+    auto changed = [since_ns](const struct ::stat& st) {
+        uint64_t mtime = uint64_t(st.st_mtim.tv_sec) * 1000000000ull + st.st_mtim.tv_nsec;
+        uint64_t ctime = uint64_t(st.st_ctim.tv_sec) * 1000000000ull + st.st_ctim.tv_nsec;
+        return std::max(mtime, ctime) >= since_ns;
+    };
+
+    struct ::stat root_st;
+    if(::lstat(root_.c_str(), &root_st) == 0 && changed(root_st)) {
+        record(root_, WATCH_EVENT_RESCAN, true);
+    }
+
+    std::vector<Path> dirs(1, root_);
+    while(!dirs.empty()) {
+        Path current = std::move(dirs.back());
+        dirs.pop_back();
+
+        std::unique_ptr<DirReader> reader;
+        try {
+            reader.reset(new DirReader(current));
+        } catch(IOError&) {
+            continue;
+        }
+
+        while(reader->next()) {
+            struct ::stat st;
+            if(::fstatat(reader->fd(), reader->name(), &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                continue;
+            }
+
+            Path child = path::join(current, reader->name());
+            bool is_dir = S_ISDIR(st.st_mode);
+
+            if(changed(st)) {
+                record(child, (is_dir) ? WATCH_EVENT_RESCAN : WATCH_EVENT_MODIFIED, is_dir);
+            }
+
+            if(is_dir) {
+                /* Gives back the existing watch if there is one */
+                int wd = ::inotify_add_watch(inotify_fd_, child.c_str(), WATCH_MASK);
+                if(wd >= 0) {
+                    watches_[wd] = child;
+                    dirs.push_back(child);
+                }
+            }
+        }
+    }
+
+    watch_count_ = watches_.size();
+#else
+    (void) (since_ns);
+#endif
+}
+
+void Watcher::record(const Path& path, uint32_t events, bool is_dir) {
+    auto now = std::chrono::steady_clock::now();
+    if(pending_.empty()) {
+        first_event_ = now;
+    }
+
+    auto it = pending_index_.find(path);
+    if(it != pending_index_.end()) {
+        WatchEvent& event = pending_[it->second];
+        event.events |= events;
+        event.is_dir = event.is_dir || is_dir;
+    } else {
+        pending_index_[path] = pending_.size();
+        pending_.push_back(WatchEvent{path, events, is_dir});
+    }
+
+    last_event_ = now;
+}
+
+void Watcher::read_events() {
+#ifdef __linux__
+    alignas(struct inotify_event) char buffer[64 * 1024];
+
+    for(;;) {
+        /* Taken before the read, so it's no later than the last event in it */
+        uint64_t reading_ns = now_ns();
+
+        ssize_t n = ::read(inotify_fd_, buffer, sizeof(buffer));
+        if(n <= 0) {
+            if(n < 0 && errno == EINTR) {
+                continue;
+            } else if(n < 0 && errno == EAGAIN) {
+                drained_ns_ = reading_ns;
+            }
+            return;
+        }
+
+        for(char* p = buffer; p < buffer + n;) {
+            const struct inotify_event* event = (const struct inotify_event*) p;
+            p += sizeof(struct inotify_event) + event->len;
+
+            if(event->mask & IN_Q_OVERFLOW) {
+                /* Events were dropped at some point after the queue was
+                 * last empty. A second's slack covers filesystems which
+                 * round their timestamps */
+                rescan(drained_ns_ - std::min<uint64_t>(drained_ns_, SNAPSHOT_RACY_NS));
+                continue;
+            }
+
+            auto it = watches_.find(event->wd);
+            if(it == watches_.end()) {
+                continue;
+            }
+
+            if(event->mask & IN_IGNORED) {
+                watches_.erase(it);
+                watch_count_ = watches_.size();
+                continue;
+            }
+
+            if(!event->len) {
+                /* An event on the watched directory itself, its parent
+                 * reports those */
+                continue;
+            }
+
+            Path path = path::join(it->second, event->name);
+            bool is_dir = (event->mask & IN_ISDIR) != 0;
+
+            uint32_t events = 0;
+            if(event->mask & (IN_CREATE | IN_MOVED_TO)) {
+                events |= WATCH_EVENT_CREATED;
+            }
+            if(event->mask & (IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB)) {
+                events |= WATCH_EVENT_MODIFIED;
+            }
+            if(event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                events |= WATCH_EVENT_REMOVED;
+            }
+
+            record(path, events, is_dir);
+
+            if(is_dir && (event->mask & IN_MOVED_FROM)) {
+                /* Whether it left the tree or was renamed within it, its
+                 * watches would report events under the old path */
+                remove_watches(path);
+            }
+
+            if(is_dir && (events & WATCH_EVENT_CREATED)) {
+                int wd = ::inotify_add_watch(inotify_fd_, path.c_str(), WATCH_MASK);
+                if(wd >= 0) {
+                    watches_[wd] = path;
+                    add_watches(path, true);
+                }
+            }
+        }
+    }
+#endif
+}
+
+void Watcher::flush() {
+    std::vector<WatchEvent> batch;
+    batch.swap(pending_);
+    pending_index_.clear();
+
+    if(callback_) {
+        callback_(batch);
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    bool was_empty = ready_.empty();
+    for(auto& event: batch) {
+        ready_.push_back(std::move(event));
+    }
+
+#ifdef KFS_POSIX
+    if(was_empty && ::write(pipe_[1], "x", 1) < 0) {
+        /* Already readable */
+    }
+#else
+    (void) (was_empty);
+#endif
+    ready_cond_.notify_all();
+}
+
+void Watcher::run() {
+#ifdef __linux__
+    /* A steady stream of events never goes quiet, so they're delivered at
+     * least every max_latency regardless */
+    auto due = [this]() {
+        return std::min(last_event_ + debounce_, first_event_ + max_latency_);
+    };
+
+    while(!stopping_) {
+        int timeout = -1;
+        if(!pending_.empty()) {
+            auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(
+                due() - std::chrono::steady_clock::now()
+            );
+            timeout = std::max<int>(0, wait.count());
+        }
+
+        struct pollfd fds[2] = {{inotify_fd_, POLLIN, 0}, {wake_[0], POLLIN, 0}};
+        if(::poll(fds, 2, timeout) < 0 && errno != EINTR) {
+            return;
+        }
+
+        if(fds[1].revents) {
+            drain_fd(wake_[0]);
+        }
+
+        if(fds[0].revents) {
+            read_events();
+        }
+
+        if(!pending_.empty() && std::chrono::steady_clock::now() >= due()) {
+            flush();
+        }
+    }
+#endif
+}
+
+std::vector<WatchEvent> Watcher::take(std::chrono::milliseconds timeout) {
+    std::vector<WatchEvent> events;
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    ready_cond_.wait_for(lock, timeout, [this]() { return !ready_.empty(); });
+
+    events.swap(ready_);
+#ifdef KFS_POSIX
+    drain_fd(pipe_[0]);
+#endif
+    return events;
+}
+
+// ================================================================================================
+// Path store
+// ================================================================================================
+
+const PathStore::Id PathStore::ROOT;
+const PathStore::Id PathStore::INVALID_ID;
+
+static uint64_t child_hash(PathStore::Id parent, const char* name, std::size_t length) {
+    return hash_bytes(name, length) ^ (uint64_t(parent) * 0x9E3779B97F4A7C15ull);
+}
+
+/* Calls func(name, length) for each component of path, with SEP standing in
+ * for the root of an absolute path. Stops early if func returns false */
+template<typename Func>
+static bool for_each_path_component(const Path& path, Func func) {
+    if(!path.empty() && path[0] == SEP) {
+        if(!func(&SEP, 1)) {
+            return false;
+        }
+    }
+
+    bool ok = true;
+    for_each_component(path, SEP, [&](std::size_t offset, std::size_t length) {
+        ok = ok && func(path.c_str() + offset, length);
+    });
+    return ok;
+}
+
+static const std::pair<uint32_t, uint32_t> NO_NAME(0xFFFFFFFF, 0);
+
+PathStore::PathStore():
+    table_(64, INVALID_ID),
+    name_table_(64, NO_NAME) {
+
+    nodes_.push_back(Node{INVALID_ID, INVALID_ID, INVALID_ID, 0, 0});
+}
+
+PathStore::Id PathStore::find_child(Id parent, const char* name, std::size_t length) const {
+    std::size_t mask = table_.size() - 1;
+    for(std::size_t slot = child_hash(parent, name, length) & mask;; slot = (slot + 1) & mask) {
+        Id id = table_[slot];
+        if(id == INVALID_ID) {
+            return INVALID_ID;
+        }
+
+        const Node& node = nodes_[id];
+        if(node.parent == parent && node.name_length == length &&
+            memcmp(names_.data() + node.name_offset, name, length) == 0) {
+            return id;
+        }
+    }
+}
+
+void PathStore::grow_table() {
+    std::vector<Id> table(table_.size() * 2, INVALID_ID);
+    std::size_t mask = table.size() - 1;
+
+    for(Id id = 1; id < nodes_.size(); ++id) {
+        const Node& node = nodes_[id];
+        std::size_t slot = child_hash(node.parent, names_.data() + node.name_offset, node.name_length) & mask;
+        while(table[slot] != INVALID_ID) {
+            slot = (slot + 1) & mask;
+        }
+        table[slot] = id;
+    }
+
+    table_.swap(table);
+}
+
+void PathStore::grow_name_table() {
+    std::vector<std::pair<uint32_t, uint32_t>> table(name_table_.size() * 2, NO_NAME);
+    std::size_t mask = table.size() - 1;
+
+    for(auto& entry: name_table_) {
+        if(entry != NO_NAME) {
+            std::size_t slot = hash_bytes(names_.data() + entry.first, entry.second) & mask;
+            while(table[slot] != NO_NAME) {
+                slot = (slot + 1) & mask;
+            }
+            table[slot] = entry;
+        }
+    }
+
+    name_table_.swap(table);
+}
+
+/* Returns the offset of name in names_, adding it if it's not there */
+uint32_t PathStore::intern(const char* name, std::size_t length) {
+    if((name_count_ + 1) * 4 > name_table_.size() * 3) {
+        grow_name_table();
+    }
+
+    std::size_t mask = name_table_.size() - 1;
+    std::size_t slot = hash_bytes(name, length) & mask;
+    for(;; slot = (slot + 1) & mask) {
+        auto& entry = name_table_[slot];
+        if(entry == NO_NAME) {
+            break;
+        } else if(entry.second == length && memcmp(names_.data() + entry.first, name, length) == 0) {
+            return entry.first;
+        }
+    }
+
+    if(names_.size() + length > std::numeric_limits<uint32_t>::max()) {
+        throw IOError("PathStore is full");
+    }
+
+    uint32_t offset = names_.size();
+    names_.insert(names_.end(), name, name + length);
+    name_table_[slot] = std::make_pair(offset, uint32_t(length));
+    ++name_count_;
+    return offset;
+}
+
+PathStore::Id PathStore::add_child(Id parent, const char* name, std::size_t length) {
+    if(nodes_.size() >= INVALID_ID) {
+        throw IOError("PathStore is full");
+    }
+
+    /* Keep the table at most 3/4 full */
+    if((nodes_.size() + 1) * 4 > table_.size() * 3) {
+        grow_table();
+    }
+
+    Id id = nodes_.size();
+    Node node;
+    node.parent = parent;
+    node.first_child = INVALID_ID;
+    node.next_sibling = nodes_[parent].first_child;
+    node.name_offset = intern(name, length);
+    node.name_length = length;
+
+    nodes_.push_back(node);
+    nodes_[parent].first_child = id;
+
+    std::size_t mask = table_.size() - 1;
+    std::size_t slot = child_hash(parent, name, length) & mask;
+    while(table_[slot] != INVALID_ID) {
+        slot = (slot + 1) & mask;
+    }
+    table_[slot] = id;
+
+    return id;
+}
+
+PathStore::Id PathStore::insert(const Path& path) {
+    Id current = ROOT;
+    for_each_path_component(path, [&](const char* name, std::size_t length) -> bool {
+        Id child = find_child(current, name, length);
+        current = (child == INVALID_ID) ? add_child(current, name, length) : child;
+        return true;
+    });
+    return current;
+}
+
+PathStore::Id PathStore::find(const Path& path) const {
+    Id current = ROOT;
+    bool found = for_each_path_component(path, [&](const char* name, std::size_t length) -> bool {
+        current = find_child(current, name, length);
+        return current != INVALID_ID;
+    });
+    return (found) ? current : INVALID_ID;
+}
+
+std::size_t PathStore::path(Id id, char* buffer, std::size_t size) const {
+    /* No separator follows the root of an absolute path */
+    auto needs_sep = [this](Id parent) -> bool {
+        const Node& node = nodes_[parent];
+        return parent != ROOT && !(node.parent == ROOT && node.name_length == 1 && names_[node.name_offset] == SEP);
+    };
+
+    std::size_t length = 0;
+    for(Id current = id; current != ROOT; current = nodes_[current].parent) {
+        length += nodes_[current].name_length + ((needs_sep(nodes_[current].parent)) ? 1 : 0);
+    }
+
+    if(length >= size) {
+        return length;
+    }
+
+    /* Fill in from the end backwards */
+    buffer[length] = '\0';
+    std::size_t end = length;
+    for(Id current = id; current != ROOT; current = nodes_[current].parent) {
+        const Node& node = nodes_[current];
+        end -= node.name_length;
+        memcpy(buffer + end, names_.data() + node.name_offset, node.name_length);
+
+        if(needs_sep(node.parent)) {
+            buffer[--end] = SEP;
+        }
+    }
+
+    return length;
+}
+
+Path PathStore::path(Id id) const {
+    char stack_buffer[256];
+    std::size_t length = path(id, stack_buffer, sizeof(stack_buffer));
+    if(length < sizeof(stack_buffer)) {
+        return Path(stack_buffer, length);
+    }
+
+    std::vector<char> buffer(length + 1);
+    path(id, buffer.data(), buffer.size());
+    return Path(buffer.data(), length);
+}
+
+void PathStore::for_each(Id id, const std::function<void (Id)>& visit) const {
+    std::vector<Id> stack(1, id);
+    while(!stack.empty()) {
+        Id current = stack.back();
+        stack.pop_back();
+        visit(current);
+
+        for(Id child = nodes_[current].first_child; child != INVALID_ID; child = nodes_[child].next_sibling) {
+            stack.push_back(child);
+        }
+    }
+}
+
+std::size_t PathStore::memory_usage() const {
+    return sizeof(*this) + nodes_.capacity() * sizeof(Node) + names_.capacity() + table_.capacity() * sizeof(Id) +
+        name_table_.capacity() * sizeof(name_table_[0]);
+}
+
+// ================================================================================================
+// Space allocation and sparse files
+// ================================================================================================
+
+#ifdef KFS_POSIX
+/* Opens path for one of the functions below that take either a path or an fd */
+static int open_for_write(const Path& path) {
+    int fd = ::open(path.c_str(), O_WRONLY | O_CLOEXEC);
+    if(fd < 0) {
+        throw IOError(errno);
+    }
+    return fd;
+}
+#endif
+
+void allocate(int fd, uint64_t offset, uint64_t length) {
+#ifdef KFS_POSIX
+    int err = preallocate(fd, offset, length);
+    if(err) {
+        throw IOError(err);
+    }
+#else
+    (void) (fd);
+    (void) (offset);
+    (void) (length);
+    throw std::logic_error("Not implemented");
+#endif
+}
+
+void allocate(const Path& path, uint64_t offset, uint64_t length) {
+#ifdef KFS_POSIX
+    ScopedFD fd(open_for_write(path));
+    allocate(fd.get(), offset, length);
+#else
+    (void) (path);
+    allocate(-1, offset, length);
+#endif
+}
+
+void punch_hole(int fd, uint64_t offset, uint64_t length) {
+#if defined(__linux__)
+    if(::fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) != 0) {
+        throw IOError(errno);
+    }
+#elif defined(KFS_POSIX)
+    (void) (fd);
+    (void) (offset);
+    (void) (length);
+    throw IOError(EOPNOTSUPP);
+#else
+    (void) (fd);
+    (void) (offset);
+    (void) (length);
+    throw std::logic_error("Not implemented");
+#endif
+}
+
+void punch_hole(const Path& path, uint64_t offset, uint64_t length) {
+#ifdef KFS_POSIX
+    ScopedFD fd(open_for_write(path));
+    punch_hole(fd.get(), offset, length);
+#else
+    (void) (path);
+    punch_hole(-1, offset, length);
+#endif
+}
+
+void zero_range(int fd, uint64_t offset, uint64_t length) {
+#ifdef KFS_POSIX
+#ifdef __linux__
+    if(::fallocate(fd, FALLOC_FL_ZERO_RANGE, offset, length) == 0) {
+        return;
+    } else if(errno != EOPNOTSUPP && errno != ENOSYS) {
+        throw IOError(errno);
+    }
+#endif
+
+    /* Write the zeros out by hand */
+    std::vector<char> zeros(std::min<uint64_t>(length, COPY_BUFFER_SIZE), 0);
+    while(length > 0) {
+        std::size_t chunk = std::min<uint64_t>(length, zeros.size());
+        pwrite_full(fd, zeros.data(), chunk, offset);
+        offset += chunk;
+        length -= chunk;
+    }
+#else
+    (void) (fd);
+    (void) (offset);
+    (void) (length);
+    throw std::logic_error("Not implemented");
+#endif
+}
+
+void zero_range(const Path& path, uint64_t offset, uint64_t length) {
+#ifdef KFS_POSIX
+    ScopedFD fd(open_for_write(path));
+    zero_range(fd.get(), offset, length);
+#else
+    (void) (path);
+    zero_range(-1, offset, length);
+#endif
+}
+
+std::vector<Extent> data_extents(int fd) {
+    std::vector<Extent> extents;
+
+#ifdef KFS_POSIX
+    struct ::stat st;
+    if(::fstat(fd, &st) != 0) {
+        throw IOError(errno);
+    }
+
+    /* Seeking moves the file offset, put it back afterwards */
+    off_t position = ::lseek(fd, 0, SEEK_CUR);
+
+    bool supported = for_each_extent(fd, 0, st.st_size, [&](uint64_t offset, uint64_t length) {
+        extents.push_back(Extent{offset, length});
+    });
+
+    if(position >= 0) {
+        ::lseek(fd, position, SEEK_SET);
+    }
+
+    if(!supported) {
+        extents.clear();
+        if(st.st_size) {
+            extents.push_back(Extent{0, uint64_t(st.st_size)});
+        }
+    }
+#else
+    (void) (fd);
+    throw std::logic_error("Not implemented");
+#endif
+
+    return extents;
+}
+
+std::vector<Extent> data_extents(const Path& path) {
+#ifdef KFS_POSIX
+    ScopedFD fd(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    if(fd.get() < 0) {
+        throw IOError(errno);
+    }
+    return data_extents(fd.get());
+#else
+    (void) (path);
+    return data_extents(-1);
+#endif
+}
+
+FreeSpace free_space(const Path& path) {
+    FreeSpace space = FreeSpace();
+
+#ifdef KFS_POSIX
+    struct statvfs st;
+    if(::statvfs(path.c_str(), &st) != 0) {
+        throw IOError(errno);
+    }
+
+    space.total = uint64_t(st.f_blocks) * st.f_frsize;
+    space.free = uint64_t(st.f_bfree) * st.f_frsize;
+    space.available = uint64_t(st.f_bavail) * st.f_frsize;
+#else
+    (void) (path);
+    throw std::logic_error("Not implemented");
+#endif
+
+    return space;
+}
+
+// ================================================================================================
+// Tree updates
+// ================================================================================================
+
+#ifdef KFS_POSIX
+typedef std::function<bool (int, const char*, const struct ::stat&)> TreeUpdate;
+
+/* Calls update(dir_fd, name, st) for root and every entry below it of the
+ * selected types, counting how many it says it changed */
+static TreeUpdateStats update_tree(const Path& root, const TreeUpdateOptions& options, const TreeUpdate& update) {
+    std::atomic<uint64_t> matched(0);
+    std::atomic<uint64_t> changed(0);
+
+    auto selected = [&options](mode_t mode) -> bool {
+        switch(entry_type_from_mode(mode)) {
+            case ENTRY_TYPE_DIR: return options.dirs;
+            case ENTRY_TYPE_FILE: return options.files;
+            case ENTRY_TYPE_LINK: return options.links;
+            default: return false;
+        }
+    };
+
+    auto apply = [&](int dir_fd, const char* name, const struct ::stat& st) {
+        if(!selected(st.st_mode)) {
+            return;
+        }
+
+        ++matched;
+        if(update(dir_fd, name, st)) {
+            charge(options.budget, 1);
+            ++changed;
+        }
+    };
+
+    struct ::stat st;
+    charge(options.budget, 1);
+    if(::fstatat(AT_FDCWD, root.c_str(), &st, AT_SYMLINK_NOFOLLOW) != 0) {
+        throw IOError(errno);
+    }
+
+    apply(AT_FDCWD, root.c_str(), st);
+
+    if(S_ISDIR(st.st_mode)) {
+        auto visit = [&](const WalkTask& task, std::vector<WalkTask>& children) {
+            std::unique_ptr<DirReader> reader;
+            try {
+                charge(options.budget, 1);
+                reader.reset(new DirReader(task.path));
+            } catch(IOError&) {
+                /* Removed while we were walking */
+                return;
+            }
+
+            struct ::stat entry;
+            while(reader->next()) {
+                charge(options.budget, 1);
+                if(::fstatat(reader->fd(), reader->name(), &entry, AT_SYMLINK_NOFOLLOW) != 0) {
+                    continue;
+                }
+
+                apply(reader->fd(), reader->name(), entry);
+
+                if(S_ISDIR(entry.st_mode)) {
+                    WalkTask child;
+                    child.path = path::join(task.path, reader->name());
+                    child.depth = task.depth + 1;
+                    children.push_back(std::move(child));
+                }
+            }
+        };
+
+        WalkTask start;
+        start.path = root;
+        start.depth = 0;
+
+        std::atomic<bool> stop(false);
+        walk_parallel(start, options.threads, visit, stop, options.budget);
+    }
+
+    TreeUpdateStats stats;
+    stats.matched = matched;
+    stats.changed = changed;
+    return stats;
+}
+
+static uint64_t timespec_ns(const struct timespec& ts) {
+    return uint64_t(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+static struct timespec ns_timespec(uint64_t ns) {
+    struct timespec ts;
+    if(ns == KEEP_TIME) {
+        ts.tv_sec = 0;
+        ts.tv_nsec = UTIME_OMIT;
+    } else {
+        ts.tv_sec = ns / 1000000000ull;
+        ts.tv_nsec = ns % 1000000000ull;
+    }
+    return ts;
+}
+#endif
+
+TreeUpdateStats chmod_tree(const Path& root, Mode dir_mode, Mode file_mode, const TreeUpdateOptions& options) {
+#ifdef KFS_POSIX
+    /* chmod always follows symlinks */
+    TreeUpdateOptions without_links = options;
+    without_links.links = false;
+
+    return update_tree(root, without_links, [=](int dir_fd, const char* name, const struct ::stat& st) -> bool {
+        mode_t mode = (S_ISDIR(st.st_mode)) ? dir_mode : file_mode;
+        if((st.st_mode & 07777) == mode) {
+            return false;
+        }
+
+        if(::fchmodat(dir_fd, name, mode, 0) != 0) {
+            throw IOError(errno);
+        }
+        return true;
+    });
+#else
+    (void) (root);
+    (void) (dir_mode);
+    (void) (file_mode);
+    (void) (options);
+    throw std::logic_error("Not implemented");
+#endif
+}
+
+TreeUpdateStats chown_tree(const Path& root, uid_t uid, gid_t gid, const TreeUpdateOptions& options) {
+#ifdef KFS_POSIX
+    return update_tree(root, options, [=](int dir_fd, const char* name, const struct ::stat& st) -> bool {
+        if((uid == uid_t(-1) || st.st_uid == uid) && (gid == gid_t(-1) || st.st_gid == gid)) {
+            return false;
+        }
+
+        if(::fchownat(dir_fd, name, uid, gid, AT_SYMLINK_NOFOLLOW) != 0) {
+            throw IOError(errno);
+        }
+        return true;
+    });
+#else
+    (void) (root);
+    (void) (uid);
+    (void) (gid);
+    (void) (options);
+    throw std::logic_error("Not implemented");
+#endif
+}
+
+TreeUpdateStats set_times_tree(const Path& root, uint64_t atime_ns, uint64_t mtime_ns, const TreeUpdateOptions& options) {
+#ifdef KFS_POSIX
+    struct timespec times[2] = {ns_timespec(atime_ns), ns_timespec(mtime_ns)};
+
+    return update_tree(root, options, [=](int dir_fd, const char* name, const struct ::stat& st) -> bool {
+#ifdef __APPLE__
+        uint64_t atime = timespec_ns(st.st_atimespec);
+        uint64_t mtime = timespec_ns(st.st_mtimespec);
+#else
+        uint64_t atime = timespec_ns(st.st_atim);
+        uint64_t mtime = timespec_ns(st.st_mtim);
+#endif
+        if((atime_ns == KEEP_TIME || atime == atime_ns) && (mtime_ns == KEEP_TIME || mtime == mtime_ns)) {
+            return false;
+        }
+
+        if(::utimensat(dir_fd, name, times, AT_SYMLINK_NOFOLLOW) != 0) {
+            throw IOError(errno);
+        }
+        return true;
+    });
+#else
+    (void) (root);
+    (void) (atime_ns);
+    (void) (mtime_ns);
+    (void) (options);
+    throw std::logic_error("Not implemented");
+#endif
+}
+
+// ================================================================================================
+// Deduplication
+// ================================================================================================
+
+static const std::size_t DEDUPE_BLOCK_SIZE = 4096;
+
+#ifdef KFS_POSIX
+struct DedupeInode {
+    std::vector<Path> paths;    /* Every path seen which links to this inode */
+    Stat st;
+    Hash first_block = 0;
+    Hash full = 0;
+    bool failed = false;
+};
+
+static Hash hash_first_block(const Path& path, IoBudget* budget) {
+    ScopedFD fd(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    if(fd.get() < 0) {
+        throw IOError(errno);
+    }
+
+    char block[DEDUPE_BLOCK_SIZE];
+    charge(budget, 1, sizeof(block));
+    std::size_t length = pread_full(fd.get(), block, sizeof(block), 0);
+    return hash_bytes(block, length);
+}
+
+/* Splits each group of inode indexes by key(index), dropping the groups
+ * left with a single member */
+template<typename Key>
+static std::vector<std::vector<std::size_t>> regroup(const std::vector<std::vector<std::size_t>>& groups, Key key) {
+    std::vector<std::vector<std::size_t>> result;
+
+    for(auto& group: groups) {
+        std::map<decltype(key(0)), std::vector<std::size_t>> split;
+        for(auto i: group) {
+            split[key(i)].push_back(i);
+        }
+
+        for(auto& entry: split) {
+            if(entry.second.size() > 1) {
+                result.push_back(std::move(entry.second));
+            }
+        }
+    }
+
+    return result;
+}
+
+/* Whether path is still the inode that was hashed, unmodified */
+static bool unchanged(const Path& path, const Stat& st) {
+    Stat now;
+    return lstat_nofollow(path, now) && now.dev == st.dev && now.ino == st.ino &&
+        now.size == st.size && now.mtime_ns == st.mtime_ns;
+}
+
+/* Whether a hardlink would leave every path with the mode and owner it had */
+static bool same_metadata(const Stat& a, const Stat& b) {
+    return (a.mode & 07777) == (b.mode & 07777) && a.uid == b.uid && a.gid == b.gid;
+}
+
+/* Compares the contents of two files of size bytes. Equal hashes aren't
+ * proof, so nothing is replaced until the bytes have been compared */
+static bool same_contents(const Path& a, const Path& b, off_t size, IoBudget* budget) {
+    ScopedFD fd_a(::open(a.c_str(), O_RDONLY | O_CLOEXEC));
+    ScopedFD fd_b(::open(b.c_str(), O_RDONLY | O_CLOEXEC));
+    if(fd_a.get() < 0 || fd_b.get() < 0) {
+        return false;
+    }
+
+    advise(fd_a.get(), 0, 0, POSIX_FADV_SEQUENTIAL);
+    advise(fd_b.get(), 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    std::vector<char> buffer_a(COPY_BUFFER_SIZE);
+    std::vector<char> buffer_b(COPY_BUFFER_SIZE);
+
+    for(off_t offset = 0; offset < size; offset += buffer_a.size()) {
+        std::size_t wanted = std::min<off_t>(buffer_a.size(), size - offset);
+        charge(budget, 2, wanted * 2);
+
+        if(pread_full(fd_a.get(), &buffer_a[0], wanted, offset) != wanted ||
+            pread_full(fd_b.get(), &buffer_b[0], wanted, offset) != wanted ||
+            memcmp(&buffer_a[0], &buffer_b[0], wanted) != 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+enum ReflinkResult {
+    REFLINK_DONE,
+    REFLINK_UNSUPPORTED,    /* The filesystem can't, nothing was made */
+    REFLINK_SKIPPED         /* The copy's owner couldn't be kept, nothing was made */
+};
+
+/* Makes temp a reflink of source, with the mode, owner and mtime of the copy
+ * it's going to replace */
+static ReflinkResult reflink_to(const Path& source, const Path& temp, const Stat& copy) {
+#ifdef FICLONE
+    ScopedFD in(::open(source.c_str(), O_RDONLY | O_CLOEXEC));
+    if(in.get() < 0) {
+        throw IOError(errno);
+    }
+
+    ScopedFD out(::open(temp.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, copy.mode & 07777));
+    if(out.get() < 0) {
+        throw IOError(errno);
+    }
+
+    if(::ioctl(out.get(), FICLONE, in.get()) != 0) {
+        int err = errno;
+        ::unlink(temp.c_str());
+        if(err == EOPNOTSUPP || err == ENOTTY || err == EXDEV || err == EINVAL) {
+            return REFLINK_UNSUPPORTED;
+        }
+        throw IOError(err);
+    }
+
+    struct ::stat made;
+    if(::fstat(out.get(), &made) != 0) {
+        int err = errno;
+        ::unlink(temp.c_str());
+        throw IOError(err);
+    }
+
+    if(made.st_uid != copy.uid || made.st_gid != copy.gid) {
+        /* Only root can give a file away */
+        if(::fchown(out.get(), copy.uid, copy.gid) != 0) {
+            ::unlink(temp.c_str());
+            return REFLINK_SKIPPED;
+        }
+    }
+
+    /* The umask (and a chown) can take bits off the mode */
+    struct timespec times[2];
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_OMIT;
+    times[1].tv_sec = copy.mtime_ns / 1000000000ull;
+    times[1].tv_nsec = copy.mtime_ns % 1000000000ull;
+    if(::fchmod(out.get(), copy.mode & 07777) != 0 || ::futimens(out.get(), times) != 0) {
+        int err = errno;
+        ::unlink(temp.c_str());
+        throw IOError(err);
+    }
+
+    return REFLINK_DONE;
+#else
+    (void) (source);
+    (void) (temp);
+    (void) (copy);
+    return REFLINK_UNSUPPORTED;
+#endif
+}
+#endif
+
+DedupeStats dedupe(const std::vector<Path>& roots, const DedupeOptions& options) {
+    DedupeStats stats;
+
+#ifdef KFS_POSIX
+    /* Every regular file, by inode */
+    std::vector<DedupeInode> inodes;
+    std::map<std::pair<dev_t, ino_t>, std::size_t> by_inode;
+
+    Query query = Query()
+        .type(ENTRY_TYPE_FILE)
+        .min_size(std::max<off_t>(options.min_size, 1))
+        .threads(options.threads)
+        .budget(options.budget);
+
+    for(auto& root: roots) {
+        for(auto& entry: find(root, query)) {
+            ++stats.files;
+
+            auto key = std::make_pair(entry.st.dev, entry.st.ino);
+            auto it = by_inode.find(key);
+            if(it != by_inode.end()) {
+                inodes[it->second].paths.push_back(std::move(entry.path));
+            } else {
+                by_inode[key] = inodes.size();
+                inodes.push_back(DedupeInode());
+                inodes.back().paths.push_back(std::move(entry.path));
+                inodes.back().st = entry.st;
+            }
+        }
+    }
+
+    /* Only files on the same device can be linked together, and hardlinks
+     * share a mode and owner, so only files which already do can be merged */
+    bool hardlinks_only = (options.method == DEDUPE_METHOD_HARDLINK);
+
+    std::vector<std::vector<std::size_t>> groups(1);
+    for(std::size_t i = 0; i < inodes.size(); ++i) {
+        groups[0].push_back(i);
+    }
+
+    groups = regroup(groups, [&](std::size_t i) {
+        const Stat& st = inodes[i].st;
+        return std::make_tuple(
+            st.dev, st.size,
+            (hardlinks_only) ? st.mode & 07777 : 0,
+            (hardlinks_only) ? st.uid : 0,
+            (hardlinks_only) ? st.gid : 0
+        );
+    });
+
+    auto hash_groups = [&](bool full) {
+        std::vector<std::size_t> pending;
+        for(auto& group: groups) {
+            pending.insert(pending.end(), group.begin(), group.end());
+        }
+
+        parallel_for(pending.size(), options.threads, [&](std::size_t n) {
+            DedupeInode& inode = inodes[pending[n]];
+            try {
+                if(!full) {
+                    inode.first_block = hash_first_block(inode.paths[0], options.budget);
+                } else if(uint64_t(inode.st.size) > DEDUPE_BLOCK_SIZE) {
+                    inode.full = hash_file(inode.paths[0], options.budget);
+                }
+            } catch(IOError&) {
+                /* Vanished or unreadable, leave it alone */
+                inode.failed = true;
+            }
+        }, options.budget);
+
+        groups = regroup(groups, [&](std::size_t i) {
+            /* Files that couldn't be read each get a group of their own */
+            return std::make_tuple(inodes[i].failed ? i : std::size_t(-1), inodes[i].first_block, inodes[i].full);
+        });
+    };
+
+    hash_groups(false);
+    hash_groups(true);
+
+    /* Keep the first path alphabetically of each group, so the same tree
+     * always dedupes the same way */
+    for(auto& group: groups) {
+        for(auto i: group) {
+            std::sort(inodes[i].paths.begin(), inodes[i].paths.end());
+        }
+        std::sort(group.begin(), group.end(), [&](std::size_t a, std::size_t b) {
+            return inodes[a].paths[0] < inodes[b].paths[0];
+        });
+    }
+
+    std::atomic<uint64_t> duplicates(0);
+    std::atomic<uint64_t> reflinked(0);
+    std::atomic<uint64_t> hardlinked(0);
+    std::atomic<uint64_t> reclaimed(0);
+
+    parallel_for(groups.size(), options.threads, [&](std::size_t g) {
+        const auto& group = groups[g];
+        const DedupeInode& kept = inodes[group[0]];
+        const Path& keep = kept.paths[0];
+
+        for(std::size_t n = 1; n < group.size(); ++n) {
+            const DedupeInode& copy = inodes[group[n]];
+            std::size_t replaced = 0;
+
+            if(!unchanged(keep, kept.st) || !unchanged(copy.paths[0], copy.st) ||
+                !same_contents(keep, copy.paths[0], copy.st.size, options.budget)) {
+                continue;
+            }
+
+            bool can_hardlink = options.method != DEDUPE_METHOD_REFLINK && same_metadata(kept.st, copy.st);
+
+            for(auto& path: copy.paths) {
+                if(options.dry_run) {
+                    ++replaced;
+                    continue;
+                }
+
+                /* Skip anything that's changed since it was compared */
+                if(!unchanged(path, copy.st) || !unchanged(keep, kept.st)) {
+                    continue;
+                }
+
+                charge(options.budget, 2);
+                Path temp = temp_name_for(path);
+
+                ReflinkResult reflink = REFLINK_UNSUPPORTED;
+                if(options.method != DEDUPE_METHOD_HARDLINK) {
+                    reflink = reflink_to(keep, temp, copy.st);
+                }
+
+                if(reflink == REFLINK_DONE) {
+                    ++reflinked;
+                } else if(reflink == REFLINK_UNSUPPORTED && can_hardlink) {
+                    if(::link(keep.c_str(), temp.c_str()) != 0) {
+                        throw IOError(errno);
+                    }
+                    ++hardlinked;
+                } else {
+                    continue;
+                }
+
+                if(::rename(temp.c_str(), path.c_str()) != 0) {
+                    int err = errno;
+                    ::unlink(temp.c_str());
+                    throw IOError(err);
+                }
+                ++replaced;
+            }
+
+            duplicates += replaced;
+
+            /* Links from outside the roots still hold on to the copy */
+            if(replaced == copy.paths.size() && copy.st.nlink == nlink_t(replaced)) {
+                reclaimed += copy.st.size;
+            }
+        }
+    }, options.budget);
+
+    stats.duplicates = duplicates;
+    stats.reflinked = reflinked;
+    stats.hardlinked = hardlinked;
+    stats.reclaimed_bytes = reclaimed;
+#else
+    (void) (roots);
+    (void) (options);
+    throw std::logic_error("Not implemented");
+#endif
+
+    return stats;
+}
+
+// ================================================================================================
+// Moving
+// ================================================================================================
+
+#ifdef KFS_POSIX
+/* Recreates a fifo, socket or device node */
+static void copy_node(const Path& dest, const struct ::stat& st) {
+    if(::mknod(dest.c_str(), st.st_mode, st.st_rdev) != 0) {
+        throw IOError(errno);
+    }
+}
+
+/* Sets a copied directory's mode and times and fsyncs it, through a
+ * descriptor opened while it's still ours to read */
+static void copy_dir_metadata(const Path& dest, const struct ::stat& st) {
+#ifdef __APPLE__
+    struct timespec times[2] = {st.st_atimespec, st.st_mtimespec};
+#else
+    struct timespec times[2] = {st.st_atim, st.st_mtim};
+#endif
+    ScopedFD fd(::open(dest.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if(fd.get() < 0 || ::fchmod(fd.get(), st.st_mode & 07777) != 0 ||
+        ::futimens(fd.get(), times) != 0 || ::fsync(fd.get()) != 0) {
+        throw IOError(errno);
+    }
+}
+
+/* Copies the tree at source to dest, which mustn't exist yet. Files are
+ * copied in parallel once all the directories exist, and directory modes
+ * and times are set last as filling them in changes both. Returns the paths
+ * copied, relative to source, parents first */
+static std::vector<Path> copy_tree(const Path& from_root, const Path& dest, const struct ::stat& root, const MoveOptions& options, MoveStats& stats) {
+    if(::mkdir(dest.c_str(), 0700) != 0) {
+        throw IOError(errno);
+    }
+
+    /* So the relative paths can be cut off what find() returns */
+    Path source = path::norm_path(from_root);
+
+    auto entries = find(source, Query().threads(options.threads).budget(options.budget));
+
+    /* A parent sorts before its children */
+    std::vector<Path> paths;
+    paths.reserve(entries.size());
+    for(auto& entry: entries) {
+        paths.push_back(entry.path.substr(source.size() + 1));
+    }
+    std::sort(paths.begin(), paths.end());
+
+    std::vector<std::pair<Path, struct ::stat>> dirs;
+    std::vector<std::pair<Path, off_t>> files;
+
+    for(auto& rel: paths) {
+        Path from = path::join(source, rel);
+        Path to = path::join(dest, rel);
+
+        struct ::stat st;
+        if(::lstat(from.c_str(), &st) != 0) {
+            throw IOError(errno);
+        }
+
+        if(S_ISDIR(st.st_mode)) {
+            /* Writable until the contents are in */
+            if(::mkdir(to.c_str(), 0700) != 0) {
+                throw IOError(errno);
+            }
+            dirs.push_back(std::make_pair(to, st));
+        } else if(S_ISREG(st.st_mode)) {
+            files.push_back(std::make_pair(rel, st.st_size));
+        } else if(S_ISLNK(st.st_mode)) {
+            copy_link(from, to);
+            ++stats.files;
+        } else {
+            copy_node(to, st);
+            ++stats.files;
+        }
+    }
+
+    parallel_for(files.size(), options.threads, [&](std::size_t i) {
+        copy_file(path::join(source, files[i].first), path::join(dest, files[i].first), options.budget, true);
+    }, options.budget);
+
+    for(auto& file: files) {
+        ++stats.files;
+        stats.bytes += file.second;
+    }
+
+    for(auto it = dirs.rbegin(); it != dirs.rend(); ++it) {
+        copy_dir_metadata(it->first, it->second);
+    }
+    copy_dir_metadata(dest, root);
+
+    return paths;
+}
+
+/* A directory that something appeared in, or that's already gone */
+static bool left_behind(int err) {
+    return err == ENOTEMPTY || err == EEXIST || err == ENOENT;
+}
+
+/* Removes the paths copy_tree() copied, children first. Anything that
+ * appeared in the meantime wasn't copied, so is left along with its parents */
+static void remove_copied(const Path& root, const std::vector<Path>& paths, IoBudget* budget) {
+    for(auto it = paths.rbegin(); it != paths.rend(); ++it) {
+        Path full = path::join(root, *it);
+
+        Stat st;
+        if(!lstat_nofollow(full, st)) {
+            continue;
+        }
+
+        charge(budget, 1);
+        if(S_ISDIR(st.mode)) {
+            if(::rmdir(full.c_str()) != 0 && !left_behind(errno)) {
+                throw IOError(errno);
+            }
+        } else if(::unlink(full.c_str()) != 0 && errno != ENOENT) {
+            throw IOError(errno);
+        }
+    }
+
+    if(::rmdir(root.c_str()) != 0 && !left_behind(errno)) {
+        throw IOError(errno);
+    }
+}
+#endif
+
+MoveStats move(const Path& source, const Path& dest, const MoveOptions& options) {
+    MoveStats stats;
+
+#ifdef KFS_POSIX
+    if(::rename(source.c_str(), dest.c_str()) == 0) {
+        stats.renamed = true;
+        return stats;
+    } else if(errno != EXDEV) {
+        throw IOError(errno);
+    }
+
+    struct ::stat st;
+    if(::lstat(source.c_str(), &st) != 0) {
+        throw IOError(errno);
+    }
+
+    /* Nothing is removed from source until the copy is on disk, or a crash
+     * could lose both */
+    if(S_ISREG(st.st_mode)) {
+        /* Already copies to a temporary and renames it into place */
+        copy_file(source, dest, options.budget, true);
+        sync_parent(dest);
+        stats.files = 1;
+        stats.bytes = st.st_size;
+
+        if(::unlink(source.c_str()) != 0) {
+            throw IOError(errno);
+        }
+        return stats;
+    }
+
+    Path temp = temp_name_for(dest);
+    std::vector<Path> copied;
+
+    try {
+        if(S_ISDIR(st.st_mode)) {
+            copied = copy_tree(source, temp, st, options, stats);
+        } else if(S_ISLNK(st.st_mode)) {
+            copy_link(source, temp);
+            stats.files = 1;
+        } else {
+            copy_node(temp, st);
+            stats.files = 1;
+        }
+
+        /* Same rules as rename: a directory only replaces an empty one */
+        if(::rename(temp.c_str(), dest.c_str()) != 0) {
+            throw IOError(errno);
+        }
+    } catch(...) {
+        remove_tree(temp);
+        throw;
+    }
+
+    sync_parent(dest);
+
+    /* Only now that dest is complete does the source go */
+    if(S_ISDIR(st.st_mode)) {
+        remove_copied(source, copied, options.budget);
+    } else if(::unlink(source.c_str()) != 0) {
+        throw IOError(errno);
+    }
+#else
+    (void) (source);
+    (void) (dest);
+    (void) (options);
+    throw std::logic_error("Not implemented");
+#endif
+
+    return stats;
+}
+
+// ================================================================================================
+// Append logs
+// ================================================================================================
+
+struct AppendLog::Record {
+    Record* next;
+    Sequence sequence;
+    std::string data;
+};
+
+#ifdef KFS_POSIX
+static int sync_data(int fd) {
+#if defined(__APPLE__)
+    /* fsync doesn't make it past the drive's cache */
+    return (::fcntl(fd, F_FULLFSYNC) == 0) ? 0 : errno;
+#elif defined(__linux__)
+    return (::fdatasync(fd) == 0) ? 0 : errno;
+#else
+    return (::fsync(fd) == 0) ? 0 : errno;
+#endif
+}
+
+#ifndef IOV_MAX
+    #define IOV_MAX 1024
+#endif
+
+/* Writes all of iov, IOV_MAX entries at a time. Partly written entries are
+ * advanced in place */
+static int writev_full(int fd, struct iovec* iov, std::size_t count) {
+    while(count > 0) {
+        ssize_t written = ::writev(fd, iov, std::min<std::size_t>(count, IOV_MAX));
+        if(written < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+
+        while(count > 0 && std::size_t(written) >= iov->iov_len) {
+            written -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+
+        if(count > 0) {
+            iov->iov_base = (char*) iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+#endif
+
+AppendLog::AppendLog(const Path& dir, const std::string& prefix, const AppendLogOptions& options):
+    dir_(dir),
+    prefix_(prefix),
+    options_(options) {
+
+#ifdef KFS_POSIX
+    /* Carry on after any segments already there */
+    uint32_t last = 0;
+    for(auto& name: path::list_dir(dir_)) {
+        if(name.size() == prefix_.size() + 9 && name.compare(0, prefix_.size() + 1, prefix_ + ".") == 0) {
+            last = std::max<uint32_t>(last, std::strtoul(name.c_str() + prefix_.size() + 1, nullptr, 10));
+        }
+    }
+    segment_ = last;
+
+    int err = (last) ? trim_segment(last) : 0;
+    if(!err) {
+        err = open_segment();
+    }
+
+    if(err) {
+        throw IOError(err);
+    }
+
+    thread_ = std::thread(&AppendLog::run, this);
+#else
+    throw std::logic_error("Not implemented");
+#endif
+}
+
+AppendLog::~AppendLog() {
+    try {
+        close();
+    } catch(...) {
+
+    }
+}
+
+AppendLog::Sequence AppendLog::append(const char* data, std::size_t length) {
+    if(error_) {
+        throw IOError(int(error_));
+    }
+
+    /* close() waits for appenders that got in before it to finish staging,
+     * so the writer doesn't stop with a record still on its way */
+    ++appending_;
+    if(stopping_) {
+        --appending_;
+        throw IOError("Appended to a closed log");
+    }
+
+    Record* record = new Record{nullptr, next_sequence_++, std::string(data, length)};
+    Sequence sequence = record->sequence;
+
+    record->next = staged_.load();
+    while(!staged_.compare_exchange_weak(record->next, record)) {}
+    --appending_;
+
+    /* Only the first record staged since the writer last looked wakes it */
+    if(!record->next) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        staged_cond_.notify_one();
+    }
+
+    return sequence;
+}
+
+void AppendLog::wait(Sequence sequence) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    durable_cond_.wait(lock, [&]() {
+        return durable_ >= sequence || error_ || finished_;
+    });
+
+    if(durable_ < sequence) {
+        if(error_) {
+            throw IOError(int(error_));
+        }
+        throw IOError("Log closed before the record was written");
+    }
+}
+
+void AppendLog::close() {
+#ifdef KFS_POSIX
+    stopping_ = true;
+    while(appending_) {
+        std::this_thread::yield();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        draining_ = true;
+        staged_cond_.notify_one();
+    }
+
+    if(thread_.joinable()) {
+        thread_.join();
+    }
+
+    int err = close_segment();
+    if(err) {
+        throw IOError(err);
+    }
+#endif
+}
+
+void AppendLog::run() {
+#ifdef KFS_POSIX
+    for(;;) {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            staged_cond_.wait(lock, [&]() { return staged_.load() || draining_; });
+        }
+
+        if(options_.commit_delay.count() && !draining_) {
+            std::this_thread::sleep_for(options_.commit_delay);
+        }
+
+        Record* staged = staged_.exchange(nullptr);
+        if(!staged && draining_) {
+            break;
+        }
+
+        auto by_sequence = [](Record* a, Record* b) {
+            return a->sequence < b->sequence;
+        };
+
+        /* The staging list is newest first, but that's the order records
+         * were pushed in, which isn't quite the order they were numbered */
+        std::size_t first = pending_.size();
+        for(; staged; staged = staged->next) {
+            pending_.push_back(staged);
+        }
+        std::reverse(pending_.begin() + first, pending_.end());
+        std::sort(pending_.begin() + first, pending_.end(), by_sequence);
+        std::inplace_merge(pending_.begin(), pending_.begin() + first, pending_.end(), by_sequence);
+
+        /* A record can be staged just after one with a later number, so only
+         * commit up to the first gap and hold the rest back until it's filled */
+        Sequence expected = durable_ + 1;
+        std::size_t ready = 0;
+        while(ready < pending_.size() && pending_[ready]->sequence == expected) {
+            ++ready;
+            ++expected;
+        }
+
+        if(error_) {
+            /* Nothing after a failed commit can be durable */
+            ready = pending_.size();
+        } else if(ready) {
+            int err = commit(&pending_[0], ready);
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            if(err) {
+                error_ = err;
+            } else {
+                durable_ = expected - 1;
+                ++commits_;
+            }
+            durable_cond_.notify_all();
+        }
+
+        for(std::size_t i = 0; i < ready; ++i) {
+            delete pending_[i];
+        }
+        pending_.erase(pending_.begin(), pending_.begin() + ready);
+    }
+
+    for(auto record: pending_) {
+        delete record;
+    }
+    pending_.clear();
+
+    /* Wake anyone waiting on a record that's never coming */
+    std::lock_guard<std::mutex> lock(mutex_);
+    finished_ = true;
+    durable_cond_.notify_all();
+#endif
+}
+
+int AppendLog::commit(Record** records, std::size_t count) {
+#ifdef KFS_POSIX
+    std::vector<struct iovec> iov;
+    iov.reserve(count);
+    off_t bytes = 0;
+
+    auto write_out = [&]() -> int {
+        int err = writev_full(fd_, iov.data(), iov.size());
+        offset_ += bytes;
+        iov.clear();
+        bytes = 0;
+        return err;
+    };
+
+    for(std::size_t i = 0; i < count; ++i) {
+        off_t length = records[i]->data.size();
+
+        /* A record bigger than a segment gets one to itself */
+        if(offset_ + bytes > 0 && offset_ + bytes + length > options_.segment_size) {
+            int err = write_out();
+            if(!err) err = close_segment();
+            if(!err) err = open_segment();
+            if(err) {
+                return err;
+            }
+        }
+
+        struct iovec entry;
+        entry.iov_base = &records[i]->data[0];
+        entry.iov_len = length;
+        iov.push_back(entry);
+        bytes += length;
+    }
+
+    int err = write_out();
+    return (err) ? err : sync_data(fd_);
+#else
+    (void) (records);
+    (void) (count);
+    return ENOSYS;
+#endif
+}
+
+int AppendLog::open_segment() {
+#ifdef KFS_POSIX
+    char name[16];
+    std::snprintf(name, sizeof(name), ".%08u", unsigned(segment_ + 1));
+    Path path = path::join(dir_, prefix_ + name);
+
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if(fd < 0) {
+        return errno;
+    }
+
+    /* Reserving the space up front saves each fdatasync allocating blocks,
+     * but the size only grows as records are written so the end of the data
+     * is always the end of the file, crash or not. The new entry in the
+     * directory has to be on disk too before anything in the segment is
+     * durable */
+    int err = 0;
+#ifdef __linux__
+    if(::fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, options_.segment_size) != 0 &&
+        errno != EOPNOTSUPP && errno != ENOSYS) {
+        err = errno;
+    }
+#endif
+    if(!err && ::fsync(fd) != 0) {
+        err = errno;
+    }
+
+    if(!err) {
+        ScopedFD dir(::open(dir_.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+        if(dir.get() < 0 || ::fsync(dir.get()) != 0) {
+            err = errno;
+        }
+    }
+
+    if(err) {
+        ::close(fd);
+        ::unlink(path.c_str());
+        return err;
+    }
+
+    fd_ = fd;
+    offset_ = 0;
+    ++segment_;
+    return 0;
+#else
+    return ENOSYS;
+#endif
+}
+
+/* Hands back the space reserved past the end of a segment that was never
+ * closed, which is what a crash leaves behind */
+int AppendLog::trim_segment(uint32_t segment) {
+#ifdef KFS_POSIX
+    char name[16];
+    std::snprintf(name, sizeof(name), ".%08u", unsigned(segment));
+    Path path = path::join(dir_, prefix_ + name);
+
+    ScopedFD fd(::open(path.c_str(), O_WRONLY | O_CLOEXEC));
+    struct stat st;
+    if(fd.get() < 0 || ::fstat(fd.get(), &st) != 0) {
+        return errno;
+    }
+
+    if(::ftruncate(fd.get(), st.st_size) != 0 || ::fsync(fd.get()) != 0) {
+        return errno;
+    }
+    return 0;
+#else
+    (void) (segment);
+    return ENOSYS;
+#endif
+}
+
+int AppendLog::close_segment() {
+#ifdef KFS_POSIX
+    if(fd_ < 0) {
+        return 0;
+    }
+
+    /* Hand back the reserved space that wasn't used */
+    int err = 0;
+    if(::ftruncate(fd_, offset_) != 0 || ::fsync(fd_) != 0) {
+        err = errno;
+    }
+
+    ::close(fd_);
+    fd_ = -1;
+    return err;
+#else
+    return 0;
+#endif
 }
 
 #ifndef _arch_dreamcast
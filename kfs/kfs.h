@@ -5,6 +5,24 @@
 #include <utility>
 #include <stdexcept>
 #include <cstdint>
+#include <unordered_map>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <list>
+#include <thread>
+#include <condition_variable>
+#include <string_view>
+
+#if defined(__has_include)
+#if __has_include(<memory_resource>)
+    #include <memory_resource>
+    #define KFS_HAS_PMR 1
+#endif
+#endif
 
 #ifdef __WIN32__
     //#error "Must implement windows support";
@@ -31,9 +49,9 @@ private:
 };
 
 #ifdef __WIN32__
-    const std::string SEP = "\\";
+    constexpr char SEP = '\\';
 #else
-    const std::string SEP = "/";
+    constexpr char SEP = '/';
 #endif
 
 typedef std::string Path;
@@ -58,16 +76,266 @@ struct Stat {
     uint32_t  atime;   /* time of last access */
     uint32_t  mtime;   /* time of last modification */
     uint32_t  ctime;   /* time of last status change */
+    uint64_t  mtime_ns; /* time of last modification, in nanoseconds */
+};
+
+/* Throttles long running operations (recursive removes, copies, walks and
+ * hashing) to a number of operations and/or bytes per second using token
+ * buckets, and counts the work done so progress can be reported. One budget
+ * can be shared between several operations running at once. With idle
+ * priority set, the threads doing the work drop to the idle I/O scheduling
+ * class (Linux only) while they do it. */
+class IoBudget {
+public:
+    IoBudget(uint64_t ops_per_second=0, uint64_t bytes_per_second=0);   /* 0 is unlimited */
+
+    void set_ops_per_second(uint64_t rate);
+    void set_bytes_per_second(uint64_t rate);
+    void set_idle_priority(bool idle) { idle_priority_ = idle; }
+    bool idle_priority() const { return idle_priority_; }
+
+    /* Blocks until the budget allows the given amount of work */
+    void acquire(uint64_t ops, uint64_t bytes=0);
+
+    uint64_t ops_done() const { return ops_done_; }
+    uint64_t bytes_done() const { return bytes_done_; }
+
+private:
+    void refill(std::chrono::steady_clock::time_point now);
+
+    std::mutex mutex_;
+    uint64_t ops_rate_;
+    uint64_t bytes_rate_;
+    double ops_tokens_;
+    double bytes_tokens_;
+    std::chrono::steady_clock::time_point last_;
+
+    std::atomic<bool> idle_priority_{false};
+    std::atomic<uint64_t> ops_done_{0};
+    std::atomic<uint64_t> bytes_done_{0};
 };
 
 std::pair<Stat, bool> lstat(const Path& path);
 
 void touch(const Path& path);
 void rename(const Path& old, const std::string& new_path);
+/* Holes in a sparse source are left as holes in the copy */
+void copy_file(const Path& source, const Path& dest, IoBudget* budget=nullptr);
+
+struct MoveOptions {
+    uint32_t threads = 0;           /* 0 is one per core */
+    IoBudget* budget = nullptr;
+};
+
+struct MoveStats {
+    bool renamed = false;           /* Moved with a rename, nothing was copied */
+    uint64_t files = 0;             /* Non-directories copied */
+    uint64_t bytes = 0;
+};
+
+/* Renames source to dest, or if they're on different filesystems copies the
+ * file or tree across (in parallel, with copy_file_range where the kernel
+ * can) keeping modes and times. The copy is built under a temporary name and
+ * renamed into place, and the source is only removed once the copy and
+ * its directory have been fsynced */
+MoveStats move(const Path& source, const Path& dest, const MoveOptions& options=MoveOptions());
+
+/* Atomically swaps two paths, which may be files or directories */
+void exchange(const Path& a, const Path& b);
+
+/* Like rename, but fails with EEXIST rather than replacing new_path */
+void rename_noreplace(const Path& old, const Path& new_path);
 
 void remove(const Path& path);
 void remove_dir(const Path& path);
-void remove_dirs(const Path& path);
+void remove_dirs(const Path& path, IoBudget* budget=nullptr);
+
+/* Reserves disk space for [offset, offset + length) with fallocate, or
+ * posix_fallocate (F_PREALLOCATE on macOS) where that's missing, extending
+ * the file if it's shorter. A longer file is never truncated. Throws
+ * IOError(EOPNOTSUPP) when the space can't be reserved */
+void allocate(const Path& path, uint64_t offset, uint64_t length);
+void allocate(int fd, uint64_t offset, uint64_t length);
+
+/* Frees the blocks behind a range, which then reads back as zeros. The
+ * file's size doesn't change. Throws IOError(EOPNOTSUPP) where unsupported */
+void punch_hole(const Path& path, uint64_t offset, uint64_t length);
+void punch_hole(int fd, uint64_t offset, uint64_t length);
+
+/* Zeroes a range, without writing the zeros where the filesystem allows */
+void zero_range(const Path& path, uint64_t offset, uint64_t length);
+void zero_range(int fd, uint64_t offset, uint64_t length);
+
+/* A run of a sparse file which holds data */
+struct Extent {
+    uint64_t offset;
+    uint64_t length;
+};
+
+/* The data (non-hole) extents of a file, found with SEEK_DATA/SEEK_HOLE.
+ * Where holes can't be detected the whole file is one extent */
+std::vector<Extent> data_extents(const Path& path);
+std::vector<Extent> data_extents(int fd);
+
+struct FreeSpace {
+    uint64_t total;
+    uint64_t free;
+    uint64_t available;     /* What's free to unprivileged users */
+};
+
+FreeSpace free_space(const Path& path);
+
+/* A file that's written through a shared memory mapping. A large range of
+ * address space is reserved up front and the file is extended (with
+ * fallocate where possible) a chunk at a time and mapped into that range in
+ * place, so pointers into the file stay valid as it grows. Only if the file
+ * outgrows the reservation is the mapping moved with mremap. The file
+ * is truncated to size() on close(). */
+class MappedWriter {
+public:
+    static const std::size_t DEFAULT_RESERVE = std::size_t(1) << 30;
+    static const std::size_t DEFAULT_CHUNK = 64 * 1024 * 1024;
+
+    explicit MappedWriter(const Path& path, std::size_t reserve=DEFAULT_RESERVE, std::size_t chunk=DEFAULT_CHUNK);
+    ~MappedWriter();
+
+    MappedWriter(const MappedWriter&) = delete;
+    MappedWriter& operator=(const MappedWriter&) = delete;
+
+    /* Grows the file by length bytes and returns where to write them */
+    char* append(std::size_t length);
+    void resize(std::size_t size);
+
+    char* data() { return base_; }
+    std::size_t size() const { return size_; }
+    std::size_t capacity() const { return capacity_; }
+
+    /* msync a range of the file, waiting for it unless async is set */
+    void flush(std::size_t offset, std::size_t length, bool async=false);
+    void flush(bool async=false) { flush(0, size_, async); }
+
+    void close();
+
+private:
+    void grow(std::size_t needed);
+
+    int fd_ = -1;
+    char* base_ = nullptr;
+    std::size_t size_ = 0;
+    std::size_t capacity_ = 0;
+    std::size_t reserve_ = 0;
+    std::size_t chunk_ = 0;
+    std::size_t page_size_ = 4096;
+};
+
+/* Keeps the contents of recently read files in memory, up to max_bytes in
+ * total, evicting the least recently used. Buffers are shared and immutable
+ * so handing one out doesn't copy it, and stay valid after eviction. A cached
+ * file is re-stat'ed at most once per revalidate_interval and re-read if its
+ * inode, size or mtime changed; invalidate() drops an entry immediately, e.g.
+ * from a file watcher. The cache is split into shards, each with its own
+ * lock, so that threads reading different files don't contend. */
+class ContentCache {
+public:
+    typedef std::shared_ptr<const std::string> Buffer;
+
+    explicit ContentCache(
+        std::size_t max_bytes,
+        std::chrono::milliseconds revalidate_interval=std::chrono::milliseconds(1000),
+        uint32_t shards=16
+    );
+
+    /* Returns the contents of path, throwing IOError if it can't be read */
+    Buffer get(const Path& path);
+
+    void invalidate(const Path& path);
+    void clear();
+
+    std::size_t bytes_held() const;
+    std::size_t entry_count() const;
+
+    uint64_t hits() const { return hits_; }
+    uint64_t misses() const { return misses_; }
+    double hit_ratio() const;
+
+private:
+    struct Entry {
+        Path path;
+        Buffer data;
+        uint64_t ino;
+        off_t size;
+        uint64_t mtime_ns;
+        std::chrono::steady_clock::time_point checked;
+    };
+
+    struct Shard {
+        mutable std::mutex mutex;
+        std::list<Entry> lru;
+        std::unordered_map<Path, std::list<Entry>::iterator> index;
+        std::size_t bytes = 0;
+    };
+
+    Shard& shard_for(const Path& path);
+    void insert(Shard& shard, Entry entry);
+
+    std::size_t shard_bytes_;
+    std::chrono::milliseconds interval_;
+    std::vector<std::unique_ptr<Shard>> shards_;
+
+    std::atomic<uint64_t> hits_{0};
+    std::atomic<uint64_t> misses_{0};
+};
+
+struct ReadOptions {
+    std::size_t chunk_size = 4 * 1024 * 1024;   /* Rounded up to the page size */
+    uint32_t threads = 0;                       /* 0 is one per core */
+    bool will_need = true;                      /* posix_fadvise(WILLNEED) the file before reading */
+    bool drop_cache = false;                    /* posix_fadvise(DONTNEED) it afterwards */
+    IoBudget* budget = nullptr;
+};
+
+struct ReadStats {
+    uint64_t bytes = 0;
+    double seconds = 0;
+
+    double bytes_per_second() const { return (seconds > 0) ? bytes / seconds : 0; }
+};
+
+/* Reads a whole file into buffer (resizing it), with a number of threads
+ * each pread'ing page aligned chunks straight into place. The raw overload
+ * reads at most capacity bytes and stats.bytes is how many were read */
+ReadStats read_file_parallel(const Path& path, std::string& buffer, const ReadOptions& options=ReadOptions());
+ReadStats read_file_parallel(const Path& path, char* buffer, std::size_t capacity, const ReadOptions& options=ReadOptions());
+
+struct LoadedFile {
+    Path path;
+    const char* data = nullptr;     /* Points into the arena */
+    std::size_t size = 0;
+    int error = 0;                  /* errno if the file couldn't be loaded */
+};
+
+/* Reads many files at once into a single arena. Files are stat'ed in
+ * parallel to size the arena, which is allocated once, then read straight
+ * into their slots in parallel. Failures are reported per file rather than
+ * thrown; a file which grew after it was sized fails with EAGAIN. The
+ * results point into arena so are only valid while it's left alone */
+std::vector<LoadedFile> load_files(const std::vector<Path>& paths, std::vector<char>& arena,
+                                   uint32_t threads=0, IoBudget* budget=nullptr);
+
+/* Does the same as remove_dirs, but in constant time: the directory is
+ * renamed into a graveyard (a .kfs-graveyard directory alongside it, unless
+ * one has been set for its filesystem), replaced with an empty one with the
+ * same mode and owner, and deleted later by a background thread. If it
+ * can't be moved it's removed there and then. Anything left in a graveyard
+ * when the process exits is picked up again by resume_deferred_removals(),
+ * which should be called at startup with each directory whose children are
+ * removed this way, or any path on a filesystem with a graveyard set */
+void remove_dirs_deferred(const Path& path);
+void resume_deferred_removals(const Path& path);
+void set_deferred_removal_graveyard(const Path& graveyard);
+void set_deferred_removal_rate(uint32_t removals_per_second);   /* 0 is unlimited */
+IoBudget& deferred_removal_budget();
+void wait_for_deferred_removals();
 
 void make_dir(const Path& path, Mode mode=0777);
 void make_dirs(const Path& path, Mode mode=0777);
@@ -75,12 +343,779 @@ void make_link(const Path& source, const Path& dest);
 
 Path temp_dir();
 
+/* Stages renames, exchanges and removals and applies them in order on
+ * commit(). If any step fails the steps already applied are undone and the
+ * error is rethrown. Removals are renamed out of the way while the
+ * transaction runs and only deleted once every step has succeeded. */
+class Transaction {
+public:
+    void rename(const Path& old, const Path& new_path);
+    void exchange(const Path& a, const Path& b);
+    void remove(const Path& path);
+
+    void commit();
+
+private:
+    enum OperationType {
+        OPERATION_RENAME,
+        OPERATION_EXCHANGE,
+        OPERATION_REMOVE
+    };
+
+    struct Operation {
+        OperationType type;
+        Path first;
+        Path second;
+    };
+
+    std::vector<Operation> operations_;
+};
+
+typedef uint64_t Hash;
+
+/* What hash_tree remembers about each file so that unchanged files
+ * (same inode, size and mtime) don't have to be read again */
+struct HashCacheEntry {
+    ino_t ino;
+    off_t size;
+    uint64_t mtime_ns;
+    Hash hash;
+};
+
+typedef std::unordered_map<Path, HashCacheEntry> HashCache;
+
+Hash hash_bytes(const void* data, std::size_t length);
+Hash hash_file(const Path& path, IoBudget* budget=nullptr);
+Hash hash_tree(const Path& path, HashCache* cache=nullptr, uint32_t threads=0, IoBudget* budget=nullptr);
+
+/* Relative paths of the entries that differ between two trees. Entries
+ * inside an added or removed directory are listed after the directory */
+struct TreeDiff {
+    std::vector<Path> added;    /* Only in the second tree */
+    std::vector<Path> removed;  /* Only in the first tree */
+    std::vector<Path> changed;  /* Files or links in both, but different */
+};
+
+struct SyncOptions {
+    bool compare_content = false;   /* Compare files by hash rather than size + mtime */
+    bool dry_run = false;           /* Only work out what would change */
+    uint32_t threads = 0;           /* 0 is one per core */
+    IoBudget* budget = nullptr;
+};
+
+TreeDiff diff_tree(const Path& a, const Path& b, bool compare_content=false, uint32_t threads=0, IoBudget* budget=nullptr);
+TreeDiff sync_tree(const Path& source, const Path& dest, const SyncOptions& options=SyncOptions());
+
+/* The metadata of a whole tree, which can be saved to a file and loaded
+ * back in on the next run. refresh() only lists directories whose mtime has
+ * changed since the snapshot was taken; files which are modified in place
+ * don't touch their directory's mtime, so their size and mtime are as of
+ * the last time that directory was listed. Directories modified within a
+ * second of the previous scan are always listed again, as their mtime may
+ * not have moved on. */
+class Snapshot {
+public:
+    struct Entry {
+        uint64_t ino;
+        uint64_t size;
+        uint64_t mtime_ns;
+        uint32_t mode;
+        uint32_t parent;        /* Index of the containing directory */
+        uint32_t first_child;   /* Children are contiguous, sorted by name */
+        uint32_t child_count;
+        uint32_t name_offset;
+        uint32_t name_length;
+    };
+
+    /* Starts a saved snapshot, followed by the root path (padded to 8 bytes),
+     * the entries and then the names */
+    struct Header {
+        char magic[8];
+        uint32_t byte_order;
+        uint32_t entry_size;
+        uint64_t entry_count;
+        uint64_t names_size;
+        uint64_t root_size;
+        uint64_t scanned_ns;
+    };
+
+    static Snapshot scan(const Path& root);
+    static Snapshot load(const Path& file);
+
+    Snapshot(Snapshot&& other);
+    Snapshot& operator=(Snapshot&& other);
+    ~Snapshot();
+
+    Snapshot(const Snapshot&) = delete;
+    Snapshot& operator=(const Snapshot&) = delete;
+
+    void save(const Path& file) const;
+    std::size_t refresh();
+
+    const Path& root() const { return root_; }
+    std::size_t size() const { return count_; }
+    const Entry& entry(std::size_t i) const { return entries_[i]; }
+
+    Path name(std::size_t i) const;
+    Path path(std::size_t i) const;
+    std::pair<std::size_t, bool> find(const Path& relative) const;
+
+private:
+    Snapshot() = default;
+
+    void release();
+    void adopt(std::vector<Entry>& entries, std::vector<char>& names);
+
+    Path root_;
+    uint64_t scanned_ns_ = 0;
+    const Entry* entries_ = nullptr;
+    std::size_t count_ = 0;
+    const char* names_ = nullptr;
+    std::size_t names_size_ = 0;
+
+    std::vector<Entry> owned_entries_;
+    std::vector<char> owned_names_;
+};
+
+/* A compact set of paths stored as a tree of components, so the directory
+ * prefixes they share are only stored once. Each path is referred to by a
+ * 32 bit id, which also stands for its directory when other paths are below
+ * it. Paths are split on SEP but not otherwise normalised; an absolute
+ * path's first component is SEP itself. */
+class PathStore {
+public:
+    typedef uint32_t Id;
+
+    static const Id ROOT = 0;           /* The empty path, everything is below it */
+    static const Id INVALID_ID = 0xFFFFFFFF;
+
+    PathStore();
+
+    /* Adds path and any missing parents, returning its id */
+    Id insert(const Path& path);
+
+    /* The id of path, or INVALID_ID if it isn't stored */
+    Id find(const Path& path) const;
+
+    /* Writes the path for id into buffer as a null terminated string if it
+     * fits. Returns its length, so a result >= size means it didn't */
+    std::size_t path(Id id, char* buffer, std::size_t size) const;
+    Path path(Id id) const;
+
+    Id parent(Id id) const { return nodes_[id].parent; }
+    std::string name(Id id) const { return std::string(names_.data() + nodes_[id].name_offset, nodes_[id].name_length); }
+
+    /* Calls visit with id and everything below it, parents before children */
+    void for_each(Id id, const std::function<void (Id)>& visit) const;
+
+    std::size_t size() const { return nodes_.size(); }
+    std::size_t memory_usage() const;
+
+private:
+    struct Node {
+        Id parent;
+        Id first_child;
+        Id next_sibling;
+        uint32_t name_offset;
+        uint32_t name_length;
+    };
+
+    Id find_child(Id parent, const char* name, std::size_t length) const;
+    Id add_child(Id parent, const char* name, std::size_t length);
+    uint32_t intern(const char* name, std::size_t length);
+    void grow_table();
+    void grow_name_table();
+
+    std::vector<Node> nodes_;
+
+    /* Each distinct name is only stored once, however many directories it's in */
+    std::vector<char> names_;
+
+    /* Open addressing on (parent, name), holding node ids */
+    std::vector<Id> table_;
+
+    /* Open addressing on name, holding (offset, length) in names_ */
+    std::vector<std::pair<uint32_t, uint32_t>> name_table_;
+    std::size_t name_count_ = 0;
+};
+
 Path exe_path();
 Path exe_dirname();
 Path get_cwd();
 
+/* get_cwd() is cached, so change directory with this rather than ::chdir */
+void change_dir(const Path& path);
+
+/* What readdir knows about an entry's type without an lstat() */
+enum EntryType {
+    ENTRY_TYPE_UNKNOWN,     /* The filesystem didn't say, lstat() it to find out */
+    ENTRY_TYPE_FILE,
+    ENTRY_TYPE_DIR,
+    ENTRY_TYPE_LINK,
+    ENTRY_TYPE_OTHER
+};
+
+struct DirEntry {
+    Path name;
+    ino_t ino;
+    EntryType type;
+};
+
+/* Reads a directory an entry at a time. On Linux this fills a buffer of the
+ * given size with getdents64 and parses the records in place, which needs far
+ * fewer syscalls than readdir on huge directories. Elsewhere it wraps readdir
+ * and the buffer size is ignored. */
+class DirReader {
+public:
+    static const std::size_t DEFAULT_BUFFER_SIZE = 1024 * 1024;
+
+    explicit DirReader(const Path& path, std::size_t buffer_size=DEFAULT_BUFFER_SIZE);
+    ~DirReader();
+
+    DirReader(const DirReader&) = delete;
+    DirReader& operator=(const DirReader&) = delete;
+
+    /* Moves to the next entry, skipping "." and "..". Returns false at the end */
+    bool next();
+
+    /* Only valid until the next call to next() */
+    const char* name() const { return name_; }
+    ino_t ino() const { return ino_; }
+    EntryType type() const { return type_; }
+
+    /* The open directory, for calls relative to it like fstatat */
+    int fd() const;
+
+private:
+    int fd_ = -1;
+    void* dir_ = nullptr;
+    std::vector<char> buffer_;
+    std::size_t pos_ = 0;
+    std::size_t end_ = 0;
+
+    const char* name_ = nullptr;
+    ino_t ino_ = 0;
+    EntryType type_ = ENTRY_TYPE_UNKNOWN;
+};
+
+enum IgnoreMatch {
+    IGNORE_MATCH_NONE,          /* No rule mentions the path */
+    IGNORE_MATCH_IGNORED,
+    IGNORE_MATCH_INCLUDED       /* The last matching rule was a negation */
+};
+
+/* A compiled set of gitignore style rules: globs with *, ?, [...] and **,
+ * a leading ! to re-include, a trailing / to only match directories and a
+ * leading or middle / to anchor the pattern to the directory the rules apply
+ * to. Later rules take precedence over earlier ones. */
+class IgnoreRules {
+public:
+    static IgnoreRules from_file(const Path& file);
+
+    void add(const std::string& pattern);
+    void add_lines(const std::string& text);
+
+    bool empty() const { return rules_.empty(); }
+
+    /* relative is the path from the directory the rules apply to */
+    IgnoreMatch match(const Path& relative, bool is_dir) const;
+
+    /* The same, for an entry called name inside the relative directory dir.
+     * The full path is only built if an anchored rule needs it. */
+    IgnoreMatch match(const Path& dir, const char* name, bool is_dir) const;
+
+private:
+    enum RuleKind {
+        RULE_LITERAL,
+        RULE_SUFFIX,
+        RULE_GLOB
+    };
+
+    struct Rule {
+        std::string pattern;
+        RuleKind kind;
+        bool negate;
+        bool dir_only;
+        bool anchored;
+    };
+
+    std::vector<Rule> rules_;
+};
+
+struct FoundEntry {
+    Path path;
+    EntryType type;
+    uint32_t depth;         /* Children of the root are at depth 1 */
+    bool has_stat;          /* Only set if a predicate or the ordering needed it */
+    Stat st;
+};
+
+enum FindOrder {
+    FIND_ORDER_NONE,        /* Whatever order the walk finds them in */
+    FIND_ORDER_LARGEST,
+    FIND_ORDER_SMALLEST,
+    FIND_ORDER_NEWEST,
+    FIND_ORDER_OLDEST
+};
+
+/* Predicates for find(), which must all match. Name and type are checked
+ * against the directory entry before anything is lstat'd, and entries which
+ * fail them are never stat'd at all. */
+class Query {
+public:
+    /* Matched with fnmatch against the entry's name. As with find -name, a
+     * leading dot needn't be matched explicitly, so "*" includes dotfiles */
+    Query& name(const std::string& glob) { name_ = glob; return *this; }
+    Query& type(EntryType type) { type_ = type; return *this; }
+    Query& min_size(off_t bytes) { min_size_ = bytes; return *this; }
+    Query& max_size(off_t bytes) { max_size_ = bytes; return *this; }
+    Query& modified_after(uint64_t mtime_ns) { modified_after_ = mtime_ns; return *this; }
+    Query& modified_before(uint64_t mtime_ns) { modified_before_ = mtime_ns; return *this; }
+    Query& min_depth(uint32_t depth) { min_depth_ = depth; return *this; }
+    Query& max_depth(uint32_t depth) { max_depth_ = depth; return *this; }
+    Query& uid(uid_t uid) { uid_ = uid; has_uid_ = true; return *this; }
+    Query& where(std::function<bool (const FoundEntry&)> predicate) { where_ = predicate; return *this; }
+
+    /* Entries matching these rules are skipped, and ignored directories are
+     * never opened. If a file name is given, rules found in files of that
+     * name (e.g. ".gitignore") are layered on as the walk descends. */
+    Query& ignore(const IgnoreRules& rules) { ignore_ = rules; return *this; }
+    Query& ignore_files(const std::string& name) { ignore_file_ = name; return *this; }
+
+    /* With an order, limit keeps the top N; without one the walk stops as
+     * soon as N entries have been found */
+    Query& order_by(FindOrder order) { order_ = order; return *this; }
+    Query& limit(std::size_t count) { limit_ = count; return *this; }
+    Query& threads(uint32_t count) { threads_ = count; return *this; }
+    Query& budget(IoBudget* budget) { budget_ = budget; return *this; }
+
+private:
+    friend std::vector<FoundEntry> find(const Path& root, const Query& query);
+
+    bool needs_stat() const;
+
+    std::string name_;
+    EntryType type_ = ENTRY_TYPE_UNKNOWN;
+    off_t min_size_ = 0;
+    off_t max_size_ = std::numeric_limits<off_t>::max();
+    uint64_t modified_after_ = 0;
+    uint64_t modified_before_ = std::numeric_limits<uint64_t>::max();
+    uint32_t min_depth_ = 1;
+    uint32_t max_depth_ = std::numeric_limits<uint32_t>::max();
+    uid_t uid_ = 0;
+    bool has_uid_ = false;
+    std::function<bool (const FoundEntry&)> where_;
+    IgnoreRules ignore_;
+    std::string ignore_file_;
+
+    FindOrder order_ = FIND_ORDER_NONE;
+    std::size_t limit_ = 0;
+    uint32_t threads_ = 0;
+    IoBudget* budget_ = nullptr;
+};
+
+std::vector<FoundEntry> find(const Path& root, const Query& query=Query());
+
+struct TreeUpdateOptions {
+    bool files = true;
+    bool dirs = true;
+    bool links = false;             /* Symlinks themselves, ignored by chmod_tree */
+    uint32_t threads = 0;           /* 0 is one per core */
+    IoBudget* budget = nullptr;
+};
+
+struct TreeUpdateStats {
+    uint64_t matched = 0;           /* Entries of the selected types */
+    uint64_t changed = 0;           /* Of those, how many weren't already right */
+};
+
+/* Passing KEEP_TIME to set_times_tree leaves that time alone, as does -1
+ * for the uid or gid in chown_tree */
+static const uint64_t KEEP_TIME = std::numeric_limits<uint64_t>::max();
+
+/* Set the mode, owner or times of root and everything below it. The tree is
+ * walked in parallel, every entry is changed relative to its directory's fd
+ * and entries which already match are left alone */
+TreeUpdateStats chmod_tree(const Path& root, Mode dir_mode, Mode file_mode,
+                           const TreeUpdateOptions& options=TreeUpdateOptions());
+TreeUpdateStats chown_tree(const Path& root, uid_t uid, gid_t gid,
+                           const TreeUpdateOptions& options=TreeUpdateOptions());
+TreeUpdateStats set_times_tree(const Path& root, uint64_t atime_ns, uint64_t mtime_ns,
+                               const TreeUpdateOptions& options=TreeUpdateOptions());
+
+enum DedupeMethod {
+    DEDUPE_METHOD_AUTO,         /* A reflink where the filesystem allows, a hardlink otherwise */
+    DEDUPE_METHOD_REFLINK,      /* Only reflinks, duplicates are left alone if unsupported */
+    DEDUPE_METHOD_HARDLINK      /* Only files with the same mode and owner are merged */
+};
+
+struct DedupeOptions {
+    DedupeMethod method = DEDUPE_METHOD_AUTO;
+    off_t min_size = 1;             /* Smaller files aren't worth it */
+    bool dry_run = false;           /* Only work out what would be reclaimed */
+    uint32_t threads = 0;           /* 0 is one per core */
+    IoBudget* budget = nullptr;
+};
+
+struct DedupeStats {
+    uint64_t files = 0;             /* Regular files seen */
+    uint64_t duplicates = 0;        /* Paths replaced with a link to an identical file */
+    uint64_t reflinked = 0;
+    uint64_t hardlinked = 0;
+    uint64_t reclaimed_bytes = 0;
+};
+
+/* Finds files with identical contents under roots and replaces the copies
+ * with reflinks or hardlinks to one of them. Candidates are narrowed down by
+ * size, then a hash of their first block, then a hash of the whole file, and
+ * finally compared byte for byte. Paths which are already links to the same
+ * inode count as one file. Each copy is swapped out atomically by linking to
+ * a temporary name and renaming it over the copy, provided neither file has
+ * changed since. Reflinks keep the copy's mode and owner; a hardlink is only
+ * used where the two files already share them. Space is only counted as
+ * reclaimed once every link to a copy has been replaced */
+DedupeStats dedupe(const std::vector<Path>& roots, const DedupeOptions& options=DedupeOptions());
+
+struct PrefetchOptions {
+    uint32_t threads = 0;           /* 0 is one per core */
+    uint64_t max_bytes = 0;         /* Stop once this much has been covered, 0 is unlimited */
+    IoBudget* budget = nullptr;
+};
+
+struct PrefetchStats {
+    uint64_t files = 0;
+    uint64_t bytes = 0;
+    uint64_t failed = 0;            /* Paths which couldn't be opened */
+};
+
+/* Asks the kernel to pull files into the page cache (readahead/WILLNEED)
+ * ahead of them being read, in parallel. Given a directory, every file
+ * under it is prefetched. With max_bytes set, earlier paths in the list are
+ * the ones that get covered */
+PrefetchStats prefetch(const std::vector<Path>& paths, const PrefetchOptions& options=PrefetchOptions());
+PrefetchStats prefetch(const Path& root, const PrefetchOptions& options=PrefetchOptions());
+
+/* The opposite of prefetch, drops the files' clean pages from the page cache
+ * (DONTNEED). Useful after a one off bulk read so it doesn't push out hot data */
+PrefetchStats evict(const std::vector<Path>& paths, const PrefetchOptions& options=PrefetchOptions());
+PrefetchStats evict(const Path& root, const PrefetchOptions& options=PrefetchOptions());
+
+enum WatchEventType {
+    WATCH_EVENT_CREATED = 1,
+    WATCH_EVENT_MODIFIED = 2,
+    WATCH_EVENT_REMOVED = 4,
+    WATCH_EVENT_RESCAN = 8      /* Events were lost, the directory's entries may have changed */
+};
+
+struct WatchEvent {
+    Path path;
+    uint32_t events;            /* WatchEventType flags, everything seen during the window */
+    bool is_dir;
+};
+
+/* Watches a directory tree for changes with inotify, adding watches to new
+ * subdirectories as they appear and dropping them from directories moved
+ * away. Events for the same path are merged until nothing has happened for
+ * the debounce window, or max_latency has passed since the first of them,
+ * then delivered as a batch: to the callback on the watcher's own thread,
+ * or if there isn't one, queued up for take(), with fd() becoming readable
+ * so it can sit in a poll loop. If the kernel queue overflows the tree is
+ * rescanned for anything modified since the queue was last emptied: such
+ * files are reported as MODIFIED, and such directories as RESCAN, as their
+ * entries may have changed without an event. */
+class Watcher {
+public:
+    typedef std::function<void (const std::vector<WatchEvent>&)> Callback;
+
+    explicit Watcher(
+        const Path& root,
+        std::chrono::milliseconds debounce=std::chrono::milliseconds(50),
+        Callback callback=Callback(),
+        std::chrono::milliseconds max_latency=std::chrono::milliseconds(1000)
+    );
+    ~Watcher();
+
+    Watcher(const Watcher&) = delete;
+    Watcher& operator=(const Watcher&) = delete;
+
+    /* Readable while there are batches waiting for take() */
+    int fd() const { return pipe_[0]; }
+
+    /* Returns the queued events, waiting up to timeout for some to arrive */
+    std::vector<WatchEvent> take(std::chrono::milliseconds timeout=std::chrono::milliseconds(0));
+
+    std::size_t watch_count() const { return watch_count_; }
+
+private:
+    void run();
+    void add_watches(const Path& dir, bool report);
+    void remove_watches(const Path& dir);
+    void rescan(uint64_t since_ns);
+    void read_events();
+    void record(const Path& path, uint32_t events, bool is_dir);
+    void flush();
+
+    Path root_;
+    std::chrono::milliseconds debounce_;
+    Callback callback_;
+    std::chrono::milliseconds max_latency_;
+
+    int inotify_fd_ = -1;
+    int pipe_[2] = {-1, -1};
+    int wake_[2] = {-1, -1};
+
+    /* Only touched by the watcher thread once it's running */
+    std::unordered_map<int, Path> watches_;
+    std::vector<WatchEvent> pending_;
+    std::unordered_map<Path, std::size_t> pending_index_;
+    std::chrono::steady_clock::time_point first_event_;
+    std::chrono::steady_clock::time_point last_event_;
+    uint64_t drained_ns_ = 0;   /* When the kernel queue was last known to be empty */
+
+    std::mutex mutex_;
+    std::condition_variable ready_cond_;
+    std::vector<WatchEvent> ready_;
+
+    std::atomic<std::size_t> watch_count_{0};
+    std::atomic<bool> stopping_{false};
+    std::thread thread_;
+};
+
+struct AppendLogOptions {
+    off_t segment_size = 64 * 1024 * 1024;      /* Segments are rotated once they'd grow past this */
+    std::chrono::microseconds commit_delay{0};  /* How long a commit waits for more records to join it */
+};
+
+/* An append only log, split into numbered segment files (<prefix>.00000001
+ * and so on) in a directory. Any thread can append() without taking a lock:
+ * records are pushed onto a staging list, and a background thread writes
+ * everything staged with one writev() and one fdatasync() per commit, so the
+ * cost of a sync is shared by every record that arrived during the last one.
+ * Records are written as given, in sequence number order, and a record is
+ * durable once durable() has reached its number. Space for segment_size is
+ * reserved when a segment is opened, but a segment's size is only ever what
+ * has been written, so after a crash the last one ends where its data does.
+ * Reopening hands back the reserved space it was left with and carries on in
+ * a new segment. Records appended before close() are written before it
+ * returns, and appending after it throws. */
+class AppendLog {
+public:
+    typedef uint64_t Sequence;
+
+    explicit AppendLog(const Path& dir, const std::string& prefix="log", const AppendLogOptions& options=AppendLogOptions());
+    ~AppendLog();
+
+    AppendLog(const AppendLog&) = delete;
+    AppendLog& operator=(const AppendLog&) = delete;
+
+    /* Stages a record and returns its sequence number, the first is 1 */
+    Sequence append(const char* data, std::size_t length);
+    Sequence append(const std::string& record) { return append(record.data(), record.size()); }
+
+    /* Every record up to and including this one is on disk */
+    Sequence durable() const { return durable_; }
+
+    /* Blocks until the record is durable, throwing if it couldn't be written */
+    void wait(Sequence sequence);
+    void sync() { wait(next_sequence_ - 1); }
+
+    void close();
+
+    uint32_t segment() const { return segment_; }
+    uint64_t commits() const { return commits_; }
+
+private:
+    struct Record;
+
+    void run();
+    int commit(Record** records, std::size_t count);
+    int open_segment();
+    int trim_segment(uint32_t segment);
+    int close_segment();
+
+    Path dir_;
+    std::string prefix_;
+    AppendLogOptions options_;
+
+    /* Only touched by the writer thread once it's running */
+    int fd_ = -1;
+    off_t offset_ = 0;
+    std::vector<Record*> pending_;
+
+    std::atomic<Record*> staged_{nullptr};
+    std::atomic<Sequence> next_sequence_{1};
+    std::atomic<Sequence> durable_{0};
+    std::atomic<int> error_{0};
+    std::atomic<uint32_t> segment_{0};
+    std::atomic<uint64_t> commits_{0};
+
+    std::mutex mutex_;
+    std::condition_variable staged_cond_;
+    std::condition_variable durable_cond_;
+    bool finished_ = false;
+    std::atomic<bool> draining_{false};         /* Nothing more will be staged */
+    std::atomic<bool> stopping_{false};
+    std::atomic<std::size_t> appending_{0};
+    std::thread thread_;
+};
+
 namespace path {
 
+    /* A fixed capacity path, used for paths worked out at compile time */
+    template<std::size_t N>
+    class StaticPath {
+    public:
+        constexpr StaticPath() = default;
+
+        constexpr std::size_t size() const { return size_; }
+        constexpr bool empty() const { return size_ == 0; }
+        constexpr const char* data() const { return data_; }
+        constexpr const char* c_str() const { return data_; }
+
+        constexpr void push_back(char c) {
+            if(size_ + 1 >= N) {
+                throw std::length_error("StaticPath is full");
+            }
+            data_[size_++] = c;
+        }
+
+        constexpr void append(std::string_view text) {
+            for(char c: text) {
+                push_back(c);
+            }
+        }
+
+        constexpr void resize(std::size_t size) {
+            while(size_ > size) {
+                data_[--size_] = '\0';
+            }
+        }
+
+        constexpr operator std::string_view() const { return std::string_view(data_, size_); }
+        operator Path() const { return Path(data_, size_); }
+
+    private:
+        char data_[N] = {};
+        std::size_t size_ = 0;
+    };
+
+    constexpr bool is_absolute(std::string_view path) {
+    #ifdef _WIN32
+        return path.size() > 1 && path[1] == ':';
+    #elif defined(__PSP__)
+        return path.substr(0, 5) == "umd0:" || path.substr(0, 4) == "ms0:" ||
+            path.substr(0, 6) == "disc0:" || path.substr(0, 6) == "host0:";
+    #else
+        return !path.empty() && path[0] == '/';
+    #endif
+    }
+
+    /* split() and split_ext() without the copies, the results point into path */
+    constexpr std::pair<std::string_view, std::string_view> split_view(std::string_view path) {
+        auto i = path.rfind(SEP) + 1;
+        std::string_view head = path.substr(0, i);
+        if(head.find_first_not_of(SEP) != std::string_view::npos) {
+            head = head.substr(0, head.find_last_not_of(SEP) + 1);
+        }
+        return std::make_pair(head, path.substr(i));
+    }
+
+    constexpr std::pair<std::string_view, std::string_view> split_ext_view(std::string_view path) {
+        auto sep_index = path.rfind(SEP);
+        auto dot_index = path.rfind('.');
+
+        std::string_view::size_type filename_index = (sep_index == std::string_view::npos) ? 0 : sep_index + 1;
+        if(dot_index != std::string_view::npos && dot_index > filename_index) {
+            /* Leading dots are part of the name, not an extension */
+            for(; filename_index < dot_index; ++filename_index) {
+                if(path[filename_index] != '.') {
+                    return std::make_pair(path.substr(0, dot_index), path.substr(dot_index));
+                }
+            }
+        }
+
+        return std::make_pair(path, std::string_view());
+    }
+
+    /* The POSIX rules of norm_path(), appending the result to an empty out,
+     * which may be a std::string, a std::pmr::string or a StaticPath. Works in
+     * place on out, so nothing else is allocated */
+    template<typename Out>
+    constexpr void norm_path_into(std::string_view path, Out& out) {
+        if(path.empty()) {
+            out.push_back('.');
+            return;
+        }
+
+        std::size_t initial_slashes = (path[0] == SEP) ? 1 : 0;
+        //POSIX treats 3 or more slashes as a single one
+        if(initial_slashes && path.size() > 1 && path[1] == SEP && !(path.size() > 2 && path[2] == SEP)) {
+            initial_slashes = 2;
+        }
+
+        for(std::size_t i = 0; i < initial_slashes; ++i) {
+            out.push_back(SEP);
+        }
+
+        std::size_t count = 0;
+        std::size_t start = 0;
+        while(start < path.size()) {
+            auto end = path.find(SEP, start);
+            if(end == std::string_view::npos) {
+                end = path.size();
+            }
+
+            std::string_view comp = path.substr(start, end - start);
+            start = end + 1;
+
+            if(comp.empty() || comp == ".") {
+                continue;
+            }
+
+            if(comp == "..") {
+                std::string_view current(out.data(), out.size());
+                auto last = current.rfind(SEP);
+                std::size_t last_start = (last == std::string_view::npos || last < initial_slashes) ? initial_slashes : last + 1;
+
+                if(count && current.substr(last_start) != "..") {
+                    out.resize((last_start > initial_slashes) ? last_start - 1 : initial_slashes);
+                    --count;
+                    continue;
+                } else if(!count && initial_slashes) {
+                    /* Can't go above the root */
+                    continue;
+                }
+            }
+
+            if(count) {
+                out.push_back(SEP);
+            }
+            out.append(comp);
+            ++count;
+        }
+
+        if(out.size() == 0) {
+            out.push_back('.');
+        }
+    }
+
+    /* Compile time versions of join() and norm_path() for string literals */
+    template<std::size_t N1, std::size_t N2>
+    constexpr StaticPath<N1 + N2> static_join(const char (&p1)[N1], const char (&p2)[N2]) {
+        StaticPath<N1 + N2> result;
+        result.append(std::string_view(p1, N1 - 1));
+        result.push_back(SEP);
+        result.append(std::string_view(p2, N2 - 1));
+        return result;
+    }
+
+    template<std::size_t N>
+    constexpr StaticPath<N + 1> static_norm_path(const char (&path)[N]) {
+        StaticPath<N + 1> result;
+        norm_path_into(std::string_view(path, N - 1), result);
+        return result;
+    }
+
     Path join(const Path& p1, const Path& p2);
     Path join(const std::vector<Path>& parts);
 
@@ -91,7 +1126,6 @@ namespace path {
 
     bool exists(const Path& path);
     Path dir_name(const Path &path);
-    bool is_absolute(const Path& path);
     bool is_dir(const Path& path);
     bool is_file(const Path& path);
     bool is_link(const Path& path);
@@ -103,9 +1137,43 @@ namespace path {
     Path rel_path(const Path& path, const Path& start=Path());
     Path expand_user(const Path& path);
     std::vector<Path> list_dir(const Path& path);
+    std::vector<DirEntry> scan_dir(const Path& path, std::size_t buffer_size=DirReader::DEFAULT_BUFFER_SIZE);
 
     std::pair<Path, Path> split(const Path &path);
     std::pair<Path, Path> split_ext(const Path& path);
+
+#ifdef KFS_HAS_PMR
+    /* Overloads which allocate their results (and any temporaries) from
+     * resource, e.g. a per-request monotonic_buffer_resource */
+    std::pmr::string join(std::string_view p1, std::string_view p2, std::pmr::memory_resource* resource);
+    std::pmr::string norm_path(std::string_view path, std::pmr::memory_resource* resource);
+    std::pmr::string dir_name(std::string_view path, std::pmr::memory_resource* resource);
+    std::pair<std::pmr::string, std::pmr::string> split(std::string_view path, std::pmr::memory_resource* resource);
+    std::pair<std::pmr::string, std::pmr::string> split_ext(std::string_view path, std::pmr::memory_resource* resource);
+    std::pmr::vector<std::pmr::string> list_dir(std::string_view path, std::pmr::memory_resource* resource);
+#endif
+
+    /* Makes many paths relative to the same start, which is only made
+     * absolute and split up once */
+    class Relativizer {
+    public:
+        explicit Relativizer(const Path& start=Path());
+
+        Path relativize(const Path& path) const;
+        void relativize(const Path& path, Path& out) const;
+
+        const Path& start() const { return start_; }
+
+    private:
+        Path start_;
+        std::vector<std::pair<std::size_t, std::size_t>> parts_;
+    };
 }
 
 }
+
+/* A path literal normalised at compile time, kfs_path("a/../b") is "b" */
+#define kfs_path(literal) ([]() { \
+    constexpr auto kfs_path_result = ::kfs::path::static_norm_path(literal); \
+    return kfs_path_result; \
+}())
@@ -0,0 +1,144 @@
+/* Replaces the libc filesystem calls kfs makes with versions that count
+ * themselves and then forward to the real thing (found with RTLD_NEXT).
+ *
+ * Calls libc makes internally (e.g. the openat inside opendir) don't go
+ * through here, so each public call counts once. */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <atomic>
+#include <cstdarg>
+#include <dlfcn.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <utime.h>
+
+#include "syscall_counter.h"
+
+static std::atomic<unsigned long> counts[KFS_SYSCALL_MAX];
+
+extern "C" void kfs_syscall_counter_reset() {
+    for(auto& count: counts) {
+        count = 0;
+    }
+}
+
+extern "C" unsigned long kfs_syscall_count(int which) {
+    if(which < 0) {
+        unsigned long total = 0;
+        for(auto& count: counts) {
+            total += count;
+        }
+        return total;
+    }
+
+    return counts[which];
+}
+
+template<typename Func>
+static Func real(const char* name) {
+    return (Func) dlsym(RTLD_NEXT, name);
+}
+
+/* Defines a counted replacement for a libc function with a fixed argument list */
+#define KFS_COUNTED(category, ret, name, params, args) \
+    extern "C" ret name params { \
+        typedef ret (*Func) params; \
+        static Func func = real<Func>(#name); \
+        ++counts[category]; \
+        return func args; \
+    }
+
+KFS_COUNTED(KFS_SYSCALL_STAT, int, stat, (const char* path, struct stat* buf), (path, buf))
+KFS_COUNTED(KFS_SYSCALL_STAT, int, lstat, (const char* path, struct stat* buf), (path, buf))
+KFS_COUNTED(KFS_SYSCALL_STAT, int, fstat, (int fd, struct stat* buf), (fd, buf))
+KFS_COUNTED(KFS_SYSCALL_STAT, int, fstatat, (int dirfd, const char* path, struct stat* buf, int flags), (dirfd, path, buf, flags))
+KFS_COUNTED(KFS_SYSCALL_STAT, int, stat64, (const char* path, struct stat64* buf), (path, buf))
+KFS_COUNTED(KFS_SYSCALL_STAT, int, lstat64, (const char* path, struct stat64* buf), (path, buf))
+KFS_COUNTED(KFS_SYSCALL_STAT, int, fstat64, (int fd, struct stat64* buf), (fd, buf))
+KFS_COUNTED(KFS_SYSCALL_STAT, int, fstatat64, (int dirfd, const char* path, struct stat64* buf, int flags), (dirfd, path, buf, flags))
+KFS_COUNTED(KFS_SYSCALL_STAT, int, statx, (int dirfd, const char* path, int flags, unsigned int mask, struct statx* buf), (dirfd, path, flags, mask, buf))
+
+/* Before glibc 2.33 the stat family were wrappers around these */
+KFS_COUNTED(KFS_SYSCALL_STAT, int, __xstat, (int ver, const char* path, struct stat* buf), (ver, path, buf))
+KFS_COUNTED(KFS_SYSCALL_STAT, int, __lxstat, (int ver, const char* path, struct stat* buf), (ver, path, buf))
+KFS_COUNTED(KFS_SYSCALL_STAT, int, __fxstat, (int ver, int fd, struct stat* buf), (ver, fd, buf))
+KFS_COUNTED(KFS_SYSCALL_STAT, int, __fxstatat, (int ver, int dirfd, const char* path, struct stat* buf, int flags), (ver, dirfd, path, buf, flags))
+
+KFS_COUNTED(KFS_SYSCALL_OPEN, int, creat, (const char* path, mode_t mode), (path, mode))
+KFS_COUNTED(KFS_SYSCALL_OPEN, DIR*, opendir, (const char* path), (path))
+
+KFS_COUNTED(KFS_SYSCALL_MKDIR, int, mkdir, (const char* path, mode_t mode), (path, mode))
+KFS_COUNTED(KFS_SYSCALL_MKDIR, int, mkdirat, (int dirfd, const char* path, mode_t mode), (dirfd, path, mode))
+
+KFS_COUNTED(KFS_SYSCALL_UNLINK, int, unlink, (const char* path), (path))
+KFS_COUNTED(KFS_SYSCALL_UNLINK, int, unlinkat, (int dirfd, const char* path, int flags), (dirfd, path, flags))
+KFS_COUNTED(KFS_SYSCALL_UNLINK, int, rmdir, (const char* path), (path))
+KFS_COUNTED(KFS_SYSCALL_UNLINK, int, remove, (const char* path), (path))
+
+KFS_COUNTED(KFS_SYSCALL_GETDENTS, ssize_t, getdents64, (int fd, void* buffer, size_t length), (fd, buffer, length))
+
+/* The getdents64 calls inside readdir can't be seen from here, so each
+ * readdir counts instead. That's more than the kernel is asked for, but it
+ * grows with the directory the same way */
+KFS_COUNTED(KFS_SYSCALL_GETDENTS, struct dirent*, readdir, (DIR* dir), (dir))
+KFS_COUNTED(KFS_SYSCALL_GETDENTS, struct dirent64*, readdir64, (DIR* dir), (dir))
+KFS_COUNTED(KFS_SYSCALL_GETCWD, char*, getcwd, (char* buffer, size_t size), (buffer, size))
+
+KFS_COUNTED(KFS_SYSCALL_RENAME, int, rename, (const char* old, const char* new_path), (old, new_path))
+KFS_COUNTED(KFS_SYSCALL_RENAME, int, renameat, (int old_dirfd, const char* old, int new_dirfd, const char* new_path), (old_dirfd, old, new_dirfd, new_path))
+KFS_COUNTED(KFS_SYSCALL_RENAME, int, renameat2, (int old_dirfd, const char* old, int new_dirfd, const char* new_path, unsigned int flags), (old_dirfd, old, new_dirfd, new_path, flags))
+
+KFS_COUNTED(KFS_SYSCALL_UTIME, int, utime, (const char* path, const struct utimbuf* times), (path, times))
+KFS_COUNTED(KFS_SYSCALL_UTIME, int, utimes, (const char* path, const struct timeval times[2]), (path, times))
+KFS_COUNTED(KFS_SYSCALL_UTIME, int, utimensat, (int dirfd, const char* path, const struct timespec times[2], int flags), (dirfd, path, times, flags))
+KFS_COUNTED(KFS_SYSCALL_UTIME, int, futimens, (int fd, const struct timespec times[2]), (fd, times))
+
+/* open and openat only take a mode when creating */
+static mode_t mode_arg(int flags, va_list args) {
+    return (flags & (O_CREAT | O_TMPFILE)) ? (mode_t) va_arg(args, int) : 0;
+}
+
+extern "C" int open(const char* path, int flags, ...) {
+    typedef int (*Func)(const char*, int, ...);
+    static Func func = real<Func>("open");
+
+    va_list args;
+    va_start(args, flags);
+    mode_t mode = mode_arg(flags, args);
+    va_end(args);
+
+    ++counts[KFS_SYSCALL_OPEN];
+    return func(path, flags, mode);
+}
+
+extern "C" int open64(const char* path, int flags, ...) {
+    typedef int (*Func)(const char*, int, ...);
+    static Func func = real<Func>("open64");
+
+    va_list args;
+    va_start(args, flags);
+    mode_t mode = mode_arg(flags, args);
+    va_end(args);
+
+    ++counts[KFS_SYSCALL_OPEN];
+    return func(path, flags, mode);
+}
+
+extern "C" int openat(int dirfd, const char* path, int flags, ...) {
+    typedef int (*Func)(int, const char*, int, ...);
+    static Func func = real<Func>("openat");
+
+    va_list args;
+    va_start(args, flags);
+    mode_t mode = mode_arg(flags, args);
+    va_end(args);
+
+    ++counts[KFS_SYSCALL_OPEN];
+    return func(dirfd, path, flags, mode);
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+/* Counts of the filesystem calls made since the last reset, kept by the
+ * interposition library in syscall_counter.cpp. Linking against it (ahead of
+ * libc) is enough for its definitions to replace libc's. */
+
+enum KFSSyscall {
+    KFS_SYSCALL_STAT,       /* stat, lstat, fstat, fstatat, statx */
+    KFS_SYSCALL_OPEN,       /* open, openat, creat, opendir */
+    KFS_SYSCALL_MKDIR,      /* mkdir, mkdirat */
+    KFS_SYSCALL_UNLINK,     /* unlink, unlinkat, rmdir, remove */
+    KFS_SYSCALL_GETDENTS,   /* getdents64, and readdir once per entry it returns */
+    KFS_SYSCALL_GETCWD,
+    KFS_SYSCALL_RENAME,     /* rename, renameat, renameat2 */
+    KFS_SYSCALL_UTIME,      /* utime, utimes, utimensat, futimens */
+    KFS_SYSCALL_MAX
+};
+
+extern "C" {
+    void kfs_syscall_counter_reset();
+    unsigned long kfs_syscall_count(int which);
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <fstream>
+#include <functional>
+#include <iostream>
+
+#include "kaztest/kaztest.h"
+#include "kfs/kfs.h"
+#include "syscall_counter.h"
+
+/* Each test runs a kfs call and checks it stays within a budget of
+ * filesystem calls, so that a change which makes a common operation more
+ * expensive shows up here rather than in production */
+class SyscallTests : public TestCase {
+public:
+    void set_up() {
+        TestCase::set_up();
+
+        root_ = kfs::path::join(kfs::temp_dir(), "test_syscalls");
+        if(kfs::path::exists(root_)) {
+            kfs::remove_dirs(root_);
+        }
+
+        kfs::make_dirs(kfs::path::join(root_, "dir"));
+        file_ = kfs::path::join(root_, "file");
+        std::ofstream(file_.c_str()) << "contents";
+    }
+
+    void tear_down() {
+        TestCase::tear_down();
+        kfs::remove_dirs(root_);
+    }
+
+    void test_stat() {
+        assert_within(1, KFS_SYSCALL_STAT, [this]() { kfs::lstat(file_); });
+        assert_within(1, -1, [this]() { kfs::path::exists(file_); });
+        assert_within(1, -1, [this]() { kfs::path::is_dir(root_); });
+        assert_within(1, -1, [this]() { kfs::path::is_file(file_); });
+    }
+
+    void test_touch() {
+        assert_within(1, -1, [this]() { kfs::touch(file_); });
+        assert_within(2, -1, [this]() { kfs::touch(kfs::path::join(root_, "new")); });
+    }
+
+    void test_make_dir() {
+        assert_within(1, -1, [this]() { kfs::make_dir(kfs::path::join(root_, "made")); });
+        assert_within(2, -1, [this]() { kfs::make_dirs(kfs::path::join(root_, "dir")); });
+    }
+
+    void test_remove() {
+        assert_within(1, -1, [this]() { kfs::remove(file_); });
+        assert_within(1, -1, [this]() { kfs::remove(kfs::path::join(root_, "missing")); });
+    }
+
+    void test_rename() {
+        assert_within(1, -1, [this]() { kfs::rename(file_, kfs::path::join(root_, "renamed")); });
+    }
+
+    void test_cwd() {
+        kfs::get_cwd();
+        assert_within(0, -1, []() { kfs::get_cwd(); });
+        assert_within(0, -1, []() { kfs::path::abs_path("relative/path"); });
+        assert_within(0, -1, []() { kfs::path::rel_path("/a/b/c", "/a/d"); });
+    }
+
+    void test_list_dir() {
+        // A stat, an opendir, and a readdir for each of ., .., dir and file
+        // and the one that finds the end
+        assert_within(7, -1, [this]() { kfs::path::list_dir(root_); });
+        assert_within(5, KFS_SYSCALL_GETDENTS, [this]() { kfs::path::list_dir(root_); });
+        assert_within(3, -1, [this]() { kfs::path::scan_dir(root_); });
+    }
+
+private:
+    /* Checks func makes at most budget calls of the given kind, -1 for all */
+    void assert_within(unsigned long budget, int which, std::function<void ()> func) {
+        kfs_syscall_counter_reset();
+        func();
+        unsigned long used = kfs_syscall_count(which);
+
+        if(used > budget) {
+            std::cerr << "Used " << used << " filesystem calls, budget is " << budget << std::endl;
+        }
+        assert_true(used <= budget);
+    }
+
+    kfs::Path root_;
+    kfs::Path file_;
+};
@@ -1,5 +1,14 @@
 #pragma once
 
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <cstring>
+#include <unistd.h>
+#include <sys/wait.h>
+
 #include "kaztest/kaztest.h"
 #include "kfs/kfs.h"
 
@@ -38,6 +47,1077 @@ public:
         assert_equal(3, ret.size());
     }
 
+    void test_hash_file() {
+        auto file1 = kfs::path::join(root_, "subfolder/file1");
+        auto file2 = kfs::path::join(root_, "subfolder/file2");
+
+        assert_equal(kfs::hash_file(file1), kfs::hash_file(file2));
+        assert_equal(kfs::hash_bytes("", 0), kfs::hash_file(file1));
+
+        // Large enough to be advised as a sequential read
+        std::string contents;
+        for(int i = 0; i < 100000; ++i) {
+            contents += std::to_string(i);
+        }
+
+        write_file(file1, contents);
+        assert_equal(kfs::hash_bytes(contents.data(), contents.size()), kfs::hash_file(file1));
+        assert_not_equal(kfs::hash_file(file1), kfs::hash_file(file2));
+    }
+
+    void test_hash_tree() {
+        kfs::HashCache cache;
+
+        auto before = kfs::hash_tree(root_, &cache);
+        assert_equal(3, cache.size());
+        assert_equal(before, kfs::hash_tree(root_));
+
+        write_file(kfs::path::join(root_, "subfolder/file3"), "changed");
+        auto after = kfs::hash_tree(root_, &cache);
+        assert_not_equal(before, after);
+        assert_equal(after, kfs::hash_tree(root_, &cache, 1));
+
+        kfs::remove(kfs::path::join(root_, "subfolder/file3"));
+        assert_not_equal(after, kfs::hash_tree(root_, &cache));
+        assert_equal(2, cache.size());
+    }
+
+    void test_sync_tree() {
+        auto source = kfs::path::join(root_, "subfolder");
+        auto dest = kfs::path::join(root_, "mirror");
+
+        kfs::make_dirs(kfs::path::join(source, "nested"));
+        write_file(kfs::path::join(source, "nested/file4"), "contents");
+
+        kfs::SyncOptions options;
+        options.dry_run = true;
+        auto diff = kfs::sync_tree(source, dest, options);
+        assert_equal(5, diff.added.size());
+        assert_false(kfs::path::exists(dest));
+
+        diff = kfs::sync_tree(source, dest);
+        assert_equal(5, diff.added.size());
+        assert_true(kfs::path::is_file(kfs::path::join(dest, "nested/file4")));
+
+        diff = kfs::diff_tree(source, dest, true);
+        assert_true(diff.added.empty() && diff.removed.empty() && diff.changed.empty());
+
+        write_file(kfs::path::join(source, "file1"), "changed");
+        kfs::remove(kfs::path::join(source, "file2"));
+        write_file(kfs::path::join(dest, "extra"), "extra");
+
+        diff = kfs::sync_tree(source, dest);
+        assert_equal(0, diff.added.size());
+        assert_equal(2, diff.removed.size());
+        assert_equal(1, diff.changed.size());
+        assert_equal(std::string("file1"), diff.changed[0]);
+
+        assert_false(kfs::path::exists(kfs::path::join(dest, "file2")));
+        assert_false(kfs::path::exists(kfs::path::join(dest, "extra")));
+        assert_equal(kfs::hash_tree(source), kfs::hash_tree(dest));
+    }
+
+    void test_snapshot() {
+        auto file = kfs::path::join(root_, "snapshot");
+        {
+            auto snapshot = kfs::Snapshot::scan(kfs::path::join(root_, "subfolder"));
+            assert_equal(4, snapshot.size());
+            snapshot.save(file);
+        }
+
+        auto snapshot = kfs::Snapshot::load(file);
+        assert_equal(kfs::path::join(root_, "subfolder"), snapshot.root());
+        assert_equal(4, snapshot.size());
+
+        auto found = snapshot.find("file2");
+        assert_true(found.second);
+        assert_equal(std::string("file2"), snapshot.path(found.first));
+        assert_false(snapshot.find("file4").second);
+
+        kfs::make_dirs(kfs::path::join(root_, "subfolder/nested"));
+        kfs::touch(kfs::path::join(root_, "subfolder/nested/file4"));
+
+        assert_true(snapshot.refresh() > 0);
+        assert_equal(6, snapshot.size());
+
+        found = snapshot.find("nested/file4");
+        assert_true(found.second);
+        assert_equal(kfs::path::join("nested", "file4"), snapshot.path(found.first));
+        assert_true(S_ISREG(snapshot.entry(found.first).mode));
+    }
+
+    void test_snapshot_corrupt() {
+        auto file = kfs::path::join(root_, "snapshot");
+        auto root = kfs::path::join(root_, "subfolder");
+        kfs::Snapshot::scan(root).save(file);
+        assert_equal(4, kfs::Snapshot::load(file).size());
+
+        std::string contents;
+        kfs::read_file_parallel(file, contents);
+
+        // Point the last entry's name past the end of the names
+        kfs::Snapshot::Header header;
+        memcpy(&header, contents.data(), sizeof(header));
+        std::size_t entries = sizeof(header) + ((header.root_size + 7) & ~std::size_t(7));
+        std::size_t last = entries + (header.entry_count - 1) * sizeof(kfs::Snapshot::Entry);
+        uint32_t offset = 0xFFFFFF;
+        memcpy(&contents[last + offsetof(kfs::Snapshot::Entry, name_offset)], &offset, sizeof(offset));
+        write_file(file, contents);
+
+        assert_raises(kfs::IOError, [&]() { kfs::Snapshot::load(file); });
+
+        write_file(file, contents.substr(0, contents.size() / 2));
+        assert_raises(kfs::IOError, [&]() { kfs::Snapshot::load(file); });
+    }
+
+    void test_rel_path() {
+        assert_equal(std::string("c"), kfs::path::rel_path("/a/b/c", "/a/b"));
+        assert_equal(std::string("../c"), kfs::path::rel_path("/a/c", "/a/b"));
+        assert_equal(std::string("../../x/y"), kfs::path::rel_path("/x/y", "/a/b"));
+        assert_equal(std::string("../bc"), kfs::path::rel_path("/a/bc", "/a/b/"));
+        assert_equal(std::string("."), kfs::path::rel_path("/a/./b/", "/a/b"));
+        assert_equal(std::string("a/b"), kfs::path::rel_path("/a/b", "/"));
+        assert_equal(std::string(".."), kfs::path::rel_path("/", "/a"));
+
+        auto cwd = kfs::get_cwd();
+        kfs::change_dir(root_);
+        assert_equal(root_, kfs::get_cwd());
+        assert_equal(std::string("subfolder/file1"), kfs::path::rel_path("subfolder/../subfolder/file1"));
+
+        kfs::path::Relativizer relativizer(kfs::path::join(root_, "subfolder"));
+        kfs::Path out;
+        relativizer.relativize("subfolder/file2", out);
+        assert_equal(std::string("file2"), out);
+        assert_equal(std::string(".."), relativizer.relativize(root_));
+
+        kfs::change_dir(cwd);
+        assert_equal(cwd, kfs::get_cwd());
+    }
+
+    void test_scan_dir() {
+        auto subfolder = kfs::path::join(root_, "subfolder");
+        kfs::make_dir(kfs::path::join(subfolder, "nested"));
+
+        // A tiny buffer forces a refill between records
+        auto entries = kfs::path::scan_dir(subfolder, 64);
+        assert_equal(4, entries.size());
+
+        std::vector<kfs::Path> names;
+        for(auto& entry: entries) {
+            names.push_back(entry.name);
+            if(entry.name == "nested") {
+                assert_true(entry.type == kfs::ENTRY_TYPE_DIR || entry.type == kfs::ENTRY_TYPE_UNKNOWN);
+            }
+        }
+
+        assert_items_equal(kfs::path::list_dir(subfolder), names);
+        assert_raises(kfs::IOError, std::bind(&kfs::path::scan_dir, kfs::path::join(root_, "missing"), 1024));
+    }
+
+    void test_find() {
+        auto subfolder = kfs::path::join(root_, "subfolder");
+        kfs::make_dirs(kfs::path::join(subfolder, "nested/deeper"));
+        write_file(kfs::path::join(subfolder, "nested/big.dat"), std::string(1000, 'x'));
+        write_file(kfs::path::join(subfolder, "nested/deeper/bigger.dat"), std::string(2000, 'x'));
+        write_file(kfs::path::join(subfolder, "small.dat"), "x");
+
+        auto all = kfs::find(root_);
+        assert_equal(9, all.size());
+
+        auto dirs = kfs::find(root_, kfs::Query().type(kfs::ENTRY_TYPE_DIR));
+        assert_equal(3, dirs.size());
+
+        auto dat = kfs::find(root_, kfs::Query().name("*.dat").max_depth(3));
+        assert_equal(2, dat.size());
+        assert_false(dat[0].has_stat);
+
+        auto largest = kfs::find(root_, kfs::Query().type(kfs::ENTRY_TYPE_FILE).min_size(10).order_by(kfs::FIND_ORDER_LARGEST).limit(1));
+        assert_equal(1, largest.size());
+        assert_equal(kfs::path::join(subfolder, "nested/deeper/bigger.dat"), largest[0].path);
+        assert_equal(2000, largest[0].st.size);
+
+        auto sizes = kfs::find(root_, kfs::Query().name("*.dat").order_by(kfs::FIND_ORDER_SMALLEST).threads(1));
+        assert_equal(3, sizes.size());
+        assert_equal(1, sizes[0].st.size);
+        assert_equal(2000, sizes[2].st.size);
+
+        assert_equal(2, kfs::find(root_, kfs::Query().limit(2)).size());
+
+        // Dotfiles match a wildcard, as they do for find -name
+        write_file(kfs::path::join(subfolder, ".hidden.dat"), "x");
+        assert_equal(4, kfs::find(root_, kfs::Query().name("*.dat")).size());
+    }
+
+    void test_ignore_rules() {
+        kfs::IgnoreRules rules;
+        rules.add_lines("# Comment\n*.o\nbuild/\n/top\ndocs/**/*.tmp\n!keep.o\n");
+
+        assert_equal(kfs::IGNORE_MATCH_IGNORED, rules.match("src/main.o", false));
+        assert_equal(kfs::IGNORE_MATCH_INCLUDED, rules.match("src/keep.o", false));
+        assert_equal(kfs::IGNORE_MATCH_IGNORED, rules.match("a/b/build", true));
+        assert_equal(kfs::IGNORE_MATCH_NONE, rules.match("a/b/build", false));
+        assert_equal(kfs::IGNORE_MATCH_IGNORED, rules.match("top", false));
+        assert_equal(kfs::IGNORE_MATCH_NONE, rules.match("src/top", false));
+        assert_equal(kfs::IGNORE_MATCH_IGNORED, rules.match("docs/x.tmp", false));
+        assert_equal(kfs::IGNORE_MATCH_IGNORED, rules.match("docs/a/b/x.tmp", false));
+        assert_equal(kfs::IGNORE_MATCH_NONE, rules.match("src/x.tmp", false));
+
+        auto subfolder = kfs::path::join(root_, "subfolder");
+        kfs::make_dirs(kfs::path::join(subfolder, "build/output"));
+        kfs::make_dirs(kfs::path::join(subfolder, "src"));
+        kfs::touch(kfs::path::join(subfolder, "build/output/a.o"));
+        kfs::touch(kfs::path::join(subfolder, "src/b.o"));
+        kfs::touch(kfs::path::join(subfolder, "src/c.cpp"));
+        write_file(kfs::path::join(subfolder, ".gitignore"), "build/\nfile*\n");
+        write_file(kfs::path::join(subfolder, "src/.gitignore"), "*.o\n");
+
+        auto found = kfs::find(subfolder, kfs::Query().ignore_files(".gitignore"));
+        std::vector<kfs::Path> paths;
+        for(auto& entry: found) {
+            paths.push_back(entry.path.substr(subfolder.size() + 1));
+        }
+
+        assert_items_equal(
+            std::vector<kfs::Path>({".gitignore", "src", "src/.gitignore", "src/c.cpp"}),
+            paths
+        );
+
+        kfs::IgnoreRules extra;
+        extra.add("src");
+        assert_equal(1, kfs::find(subfolder, kfs::Query().ignore(extra).ignore_files(".gitignore")).size());
+    }
+
+    void test_exchange() {
+        auto a = kfs::path::join(root_, "subfolder/file1");
+        auto b = kfs::path::join(root_, "subfolder");
+        write_file(a, "a");
+
+        auto other = kfs::path::join(root_, "other");
+        kfs::make_dir(other);
+        kfs::touch(kfs::path::join(other, "marker"));
+
+        kfs::exchange(b, other);
+        assert_true(kfs::path::exists(kfs::path::join(root_, "subfolder/marker")));
+        assert_true(kfs::path::exists(kfs::path::join(root_, "other/file1")));
+
+        auto marker = kfs::path::join(root_, "subfolder/marker");
+        assert_raises(kfs::IOError, std::bind(&kfs::rename_noreplace, marker, b));
+        kfs::rename_noreplace(marker, kfs::path::join(root_, "marker"));
+        assert_true(kfs::path::exists(kfs::path::join(root_, "marker")));
+    }
+
+    void test_transaction() {
+        auto subfolder = kfs::path::join(root_, "subfolder");
+        auto staged = kfs::path::join(root_, "staged");
+        kfs::make_dir(staged);
+        kfs::touch(kfs::path::join(staged, "new_file"));
+
+        {
+            kfs::Transaction transaction;
+            transaction.remove(kfs::path::join(subfolder, "file1"));
+            transaction.rename(staged, subfolder);
+            transaction.rename(kfs::path::join(root_, "missing"), kfs::path::join(root_, "nowhere"));
+            assert_raises(kfs::IOError, std::bind(&kfs::Transaction::commit, &transaction));
+        }
+
+        assert_equal(3, kfs::path::list_dir(subfolder).size());
+        assert_true(kfs::path::exists(kfs::path::join(staged, "new_file")));
+        assert_equal(2, kfs::path::list_dir(root_).size());
+
+        kfs::Transaction transaction;
+        transaction.remove(kfs::path::join(subfolder, "file1"));
+        transaction.rename(staged, subfolder);
+        transaction.commit();
+
+        assert_items_equal(std::vector<kfs::Path>({"new_file"}), kfs::path::list_dir(subfolder));
+        assert_equal(1, kfs::path::list_dir(root_).size());
+    }
+
+    void test_remove_dirs_deferred() {
+        auto subfolder = kfs::path::join(root_, "subfolder");
+        kfs::make_dirs(kfs::path::join(subfolder, "nested/deeper"));
+        kfs::touch(kfs::path::join(subfolder, "nested/deeper/file4"));
+
+        kfs::remove_dirs_deferred(subfolder);
+        assert_true(kfs::path::is_dir(subfolder));
+        assert_true(kfs::path::list_dir(subfolder).empty());
+
+        kfs::wait_for_deferred_removals();
+
+        auto graveyard = kfs::path::join(root_, "graveyard_test");
+        kfs::make_dir(graveyard);
+        kfs::touch(kfs::path::join(graveyard, "file"));
+        kfs::remove_dirs_deferred(graveyard);
+        kfs::wait_for_deferred_removals();
+        kfs::resume_deferred_removals(root_);
+        kfs::wait_for_deferred_removals();
+
+        // The graveyard sits alongside, and goes once it's empty
+        assert_false(kfs::path::exists(kfs::path::join(root_, ".kfs-graveyard")));
+
+        // Left behind by another process
+        auto leftover = kfs::path::join(root_, ".kfs-graveyard/1-1-old");
+        kfs::make_dirs(kfs::path::join(leftover, "nested"));
+        kfs::resume_deferred_removals(root_);
+        kfs::wait_for_deferred_removals();
+        assert_false(kfs::path::exists(leftover));
+
+        // Only directories can be emptied, a file or a symlink is left alone
+        auto plain = kfs::path::join(root_, "plain");
+        write_file(plain, "contents");
+        assert_raises(kfs::IOError, [&]() { kfs::remove_dirs_deferred(plain); });
+        std::string contents;
+        kfs::read_file_parallel(plain, contents);
+        assert_equal(std::string("contents"), contents);
+
+        auto target = kfs::path::join(root_, "target");
+        auto link = kfs::path::join(root_, "link");
+        kfs::make_dir(target);
+        kfs::touch(kfs::path::join(target, "kept"));
+        ::symlink(target.c_str(), link.c_str());
+        assert_raises(kfs::IOError, [&]() { kfs::remove_dirs_deferred(link); });
+        assert_true(kfs::path::exists(kfs::path::join(target, "kept")));
+        kfs::remove(link);
+
+        // A graveyard someone else owns is passed over
+        if(::geteuid() == 0) {
+            auto shared = kfs::path::join(root_, "shared");
+            kfs::make_dirs(kfs::path::join(shared, "build/output"));
+            kfs::make_dir(kfs::path::join(shared, ".kfs-graveyard"));
+            ::chown(kfs::path::join(shared, ".kfs-graveyard").c_str(), 1, 1);
+            ::chown(kfs::path::join(shared, "build").c_str(), 1, 1);
+
+            kfs::remove_dirs_deferred(kfs::path::join(shared, "build"));
+            assert_true(kfs::path::list_dir(kfs::path::join(shared, "build")).empty());
+            assert_equal(1u, kfs::lstat(kfs::path::join(shared, "build")).first.uid);
+
+            // The emptied directory keeps its owner when it's moved out
+            auto theirs = kfs::path::join(root_, "theirs");
+            kfs::make_dirs(kfs::path::join(theirs, "nested"));
+            ::chown(theirs.c_str(), 1, 1);
+            ::chmod(theirs.c_str(), 0750);
+
+            kfs::remove_dirs_deferred(theirs);
+            assert_true(kfs::path::list_dir(theirs).empty());
+            assert_equal(1u, kfs::lstat(theirs).first.uid);
+            assert_equal(0750u, kfs::lstat(theirs).first.mode & 07777);
+            kfs::wait_for_deferred_removals();
+        }
+    }
+
+    void test_io_budget() {
+        kfs::IoBudget budget(100);
+
+        auto start = std::chrono::steady_clock::now();
+        for(int i = 0; i < 10; ++i) {
+            budget.acquire(1);
+        }
+        auto elapsed = std::chrono::steady_clock::now() - start;
+
+        assert_true(elapsed >= std::chrono::milliseconds(80));
+        assert_equal(10, budget.ops_done());
+
+        kfs::IoBudget unlimited;
+        unlimited.set_idle_priority(true);
+
+        auto subfolder = kfs::path::join(root_, "subfolder");
+        write_file(kfs::path::join(subfolder, "file1"), "contents");
+        kfs::hash_tree(root_, nullptr, 0, &unlimited);
+        assert_equal(8, unlimited.bytes_done());
+
+        kfs::find(root_, kfs::Query().budget(&unlimited));
+        kfs::remove_dirs(subfolder, &unlimited);
+        assert_true(kfs::path::list_dir(subfolder).empty());
+        assert_true(unlimited.ops_done() > 10);
+    }
+
+    void test_sparse_files() {
+        auto image = kfs::path::join(root_, "image");
+        const uint64_t size = 64 * 1024 * 1024;
+
+        kfs::allocate(kfs::path::join(root_, "subfolder/file1"), 0, 4096);
+        assert_equal(4096u, kfs::lstat(kfs::path::join(root_, "subfolder/file1")).first.size);
+
+        // Reserving a range inside the file never shrinks it
+        kfs::allocate(kfs::path::join(root_, "subfolder/file1"), 0, 100);
+        assert_equal(4096u, kfs::lstat(kfs::path::join(root_, "subfolder/file1")).first.size);
+
+        write_file(image, "");
+        {
+            std::fstream file(image.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+            file.seekp(10 * 1024 * 1024);
+            file << "start";
+            file.seekp(size - 5);
+            file << "end!!";
+        }
+
+        auto extents = kfs::data_extents(image);
+        assert_true(!extents.empty());
+        assert_true(extents.front().offset <= 10 * 1024 * 1024);
+        assert_equal(size, extents.back().offset + extents.back().length);
+
+        // Holes in the source stay holes in the copy
+        auto copy = kfs::path::join(root_, "copy");
+        kfs::copy_file(image, copy);
+        assert_equal(size, kfs::lstat(copy).first.size);
+        assert_equal(kfs::hash_file(image), kfs::hash_file(copy));
+        assert_true(kfs::data_extents(copy).size() <= extents.size());
+
+        kfs::zero_range(copy, size - 5, 5);
+        kfs::punch_hole(copy, 10 * 1024 * 1024, 4096);
+        assert_equal(size, kfs::lstat(copy).first.size);
+
+        std::ifstream check(copy.c_str(), std::ios::binary);
+        check.seekg(10 * 1024 * 1024);
+        char data[5] = {1, 1, 1, 1, 1};
+        check.read(data, 5);
+        assert_equal(std::string(5, '\0'), std::string(data, 5));
+
+        auto space = kfs::free_space(root_);
+        assert_true(space.total > 0);
+        assert_true(space.available <= space.free && space.free <= space.total);
+    }
+
+    void test_update_tree() {
+        auto tree = kfs::path::join(root_, "deploy");
+        kfs::make_dirs(kfs::path::join(tree, "a/b"));
+        write_file(kfs::path::join(tree, "a/one"), "1");
+        write_file(kfs::path::join(tree, "a/b/two"), "2");
+
+        auto stats = kfs::chmod_tree(tree, 0750, 0640);
+        assert_equal(5u, stats.matched);
+        assert_equal(0750u, kfs::lstat(kfs::path::join(tree, "a/b")).first.mode & 07777);
+        assert_equal(0640u, kfs::lstat(kfs::path::join(tree, "a/b/two")).first.mode & 07777);
+
+        // Nothing to do the second time around
+        assert_equal(0u, kfs::chmod_tree(tree, 0750, 0640).changed);
+
+        kfs::TreeUpdateOptions files_only;
+        files_only.dirs = false;
+        stats = kfs::chmod_tree(tree, 0700, 0600, files_only);
+        assert_equal(2u, stats.matched);
+        assert_equal(2u, stats.changed);
+        assert_equal(0750u, kfs::lstat(kfs::path::join(tree, "a")).first.mode & 07777);
+
+        const uint64_t when = 1500000000123456789ull;
+        stats = kfs::set_times_tree(tree, kfs::KEEP_TIME, when);
+        assert_equal(5u, stats.changed);
+        assert_equal(when, kfs::lstat(kfs::path::join(tree, "a/one")).first.mtime_ns);
+        assert_equal(0u, kfs::set_times_tree(tree, kfs::KEEP_TIME, when).changed);
+
+        auto st = kfs::lstat(tree).first;
+        stats = kfs::chown_tree(tree, st.uid, st.gid);
+        assert_equal(5u, stats.matched);
+        assert_equal(0u, stats.changed);
+    }
+
+    void test_dedupe() {
+        auto store = kfs::path::join(root_, "store");
+        kfs::make_dirs(kfs::path::join(store, "build1"));
+        kfs::make_dirs(kfs::path::join(store, "build2"));
+
+        std::string contents(10000, 'x');
+        std::string different_start = "y" + contents.substr(1);
+        std::string different_end = contents.substr(1) + "z";
+
+        write_file(kfs::path::join(store, "build1/a"), contents);
+        write_file(kfs::path::join(store, "build1/b"), contents);
+        write_file(kfs::path::join(store, "build2/a"), contents);
+        write_file(kfs::path::join(store, "build2/start"), different_start);
+        write_file(kfs::path::join(store, "build2/end"), different_end);
+        ::link(kfs::path::join(store, "build1/a").c_str(), kfs::path::join(store, "build1/a_link").c_str());
+
+        kfs::DedupeOptions options;
+        options.method = kfs::DEDUPE_METHOD_HARDLINK;
+        options.dry_run = true;
+
+        auto stats = kfs::dedupe({store}, options);
+        assert_equal(6u, stats.files);
+        assert_equal(2u, stats.duplicates);
+        assert_equal(20000u, stats.reclaimed_bytes);
+        assert_not_equal(
+            kfs::lstat(kfs::path::join(store, "build1/a")).first.ino,
+            kfs::lstat(kfs::path::join(store, "build2/a")).first.ino
+        );
+
+        options.dry_run = false;
+        stats = kfs::dedupe({kfs::path::join(store, "build1"), kfs::path::join(store, "build2")}, options);
+        assert_equal(2u, stats.hardlinked);
+        assert_equal(20000u, stats.reclaimed_bytes);
+
+        auto ino = kfs::lstat(kfs::path::join(store, "build1/a")).first.ino;
+        assert_equal(ino, kfs::lstat(kfs::path::join(store, "build1/b")).first.ino);
+        assert_equal(ino, kfs::lstat(kfs::path::join(store, "build2/a")).first.ino);
+        assert_not_equal(ino, kfs::lstat(kfs::path::join(store, "build2/start")).first.ino);
+        assert_not_equal(ino, kfs::lstat(kfs::path::join(store, "build2/end")).first.ino);
+
+        // Already deduped
+        assert_equal(0u, kfs::dedupe({store}, options).duplicates);
+
+        // Hardlinking would change the permissions of one of them
+        auto secret = kfs::path::join(store, "secret");
+        auto shared = kfs::path::join(store, "shared");
+        write_file(secret, "private");
+        write_file(shared, "private");
+        ::chmod(secret.c_str(), 0600);
+        ::chmod(shared.c_str(), 0644);
+
+        stats = kfs::dedupe({store}, options);
+        assert_equal(0u, stats.duplicates);
+        assert_not_equal(kfs::lstat(secret).first.ino, kfs::lstat(shared).first.ino);
+    }
+
+    void test_move() {
+        auto source = kfs::path::join(root_, "results");
+        kfs::make_dirs(kfs::path::join(source, "logs"));
+        write_file(kfs::path::join(source, "summary"), "passed");
+        write_file(kfs::path::join(source, "logs/run"), std::string(3 * 1024 * 1024, 'x'));
+        kfs::make_link("summary", kfs::path::join(source, "latest"));
+        ::chmod(kfs::path::join(source, "summary").c_str(), 0640);
+        ::chmod(kfs::path::join(source, "logs").c_str(), 0750);
+
+        auto mtime = kfs::lstat(kfs::path::join(source, "logs/run")).first.mtime_ns;
+
+        // Same filesystem
+        auto renamed = kfs::path::join(root_, "renamed");
+        assert_true(kfs::move(source, renamed).renamed);
+        assert_false(kfs::path::exists(source));
+
+        // Across filesystems, if there's a tmpfs to move to
+        auto shm = kfs::path::join("/dev/shm", "kfs-test-move");
+        if(!kfs::path::is_dir("/dev/shm") || kfs::lstat("/dev/shm").first.dev == kfs::lstat(root_).first.dev) {
+            return;
+        }
+
+        if(kfs::path::exists(shm)) {
+            kfs::remove_dirs(shm);
+            kfs::remove_dir(shm);
+        }
+
+        auto stats = kfs::move(renamed, shm);
+        assert_false(stats.renamed);
+        assert_equal(3u, stats.files);
+        assert_equal(3u * 1024 * 1024 + 6, stats.bytes);
+        assert_false(kfs::path::exists(renamed));
+
+        std::string contents;
+        kfs::read_file_parallel(kfs::path::join(shm, "latest"), contents);
+        assert_equal(std::string("passed"), contents);
+        assert_equal(0640u, kfs::lstat(kfs::path::join(shm, "summary")).first.mode & 07777);
+        assert_equal(0750u, kfs::lstat(kfs::path::join(shm, "logs")).first.mode & 07777);
+        assert_equal(mtime, kfs::lstat(kfs::path::join(shm, "logs/run")).first.mtime_ns);
+
+        // And a single file back again
+        kfs::move(kfs::path::join(shm, "logs/run"), kfs::path::join(root_, "run"));
+        assert_equal(3u * 1024 * 1024, kfs::lstat(kfs::path::join(root_, "run")).first.size);
+        assert_false(kfs::path::exists(kfs::path::join(shm, "logs/run")));
+
+        // Something written to the source once it's been copied is left there
+        auto late = kfs::path::join(root_, "late");
+        auto moved = kfs::path::join(shm, "late");
+        kfs::make_dirs(kfs::path::join(late, "logs"));
+        write_file(kfs::path::join(late, "logs/run"), "output");
+
+        kfs::IoBudget slow(20);
+        std::thread writer([&]() {
+            while(!kfs::path::exists(moved)) {
+                std::this_thread::yield();
+            }
+            write_file(kfs::path::join(late, "logs/extra"), "new");
+        });
+
+        kfs::MoveOptions options;
+        options.budget = &slow;
+        try {
+            kfs::move(late, moved, options);
+        } catch(...) {
+            writer.join();
+            throw;
+        }
+        writer.join();
+
+        assert_true(kfs::path::exists(kfs::path::join(moved, "logs/run")));
+        assert_false(kfs::path::exists(kfs::path::join(late, "logs/run")));
+        assert_true(kfs::path::exists(kfs::path::join(late, "logs/extra")));
+
+        kfs::remove_dirs(shm);
+        kfs::remove_dir(shm);
+    }
+
+    void test_append_log() {
+        auto dir = kfs::path::join(root_, "audit");
+        kfs::make_dirs(dir);
+
+        kfs::AppendLogOptions options;
+        options.segment_size = 1000;
+
+        const int threads = 8;
+        const int per_thread = 200;
+
+        uint32_t segments = 0;
+        {
+            kfs::AppendLog log(dir, "audit", options);
+
+            std::vector<std::thread> writers;
+            for(int t = 0; t < threads; ++t) {
+                writers.push_back(std::thread([&log, t]() {
+                    kfs::AppendLog::Sequence last = 0;
+                    for(int i = 0; i < per_thread; ++i) {
+                        char record[16];
+                        std::snprintf(record, sizeof(record), "%d:%05d\n", t, i);
+                        last = log.append(record);
+                    }
+                    log.wait(last);
+                }));
+            }
+
+            for(auto& writer: writers) {
+                writer.join();
+            }
+
+            assert_equal(uint64_t(threads * per_thread), log.durable());
+            assert_true(log.commits() <= uint64_t(threads * per_thread));
+
+            // Too big for a segment, so it gets one of its own
+            log.append(std::string(1500, 'x') + "\n");
+            log.sync();
+            segments = log.segment();
+        }
+
+        std::string contents;
+        for(uint32_t i = 1; i <= segments; ++i) {
+            char name[16];
+            std::snprintf(name, sizeof(name), "audit.%08u", i);
+
+            std::string segment;
+            kfs::read_file_parallel(kfs::path::join(dir, name), segment);
+            assert_true(segment.size() <= 1000 || segment.size() == 1501);
+            contents += segment;
+        }
+
+        // Every record is there once, and each thread's are in order
+        std::vector<int> next(threads, 0);
+        std::istringstream lines(contents.substr(0, contents.size() - 1501));
+        std::string line;
+        while(std::getline(lines, line)) {
+            int t = line[0] - '0';
+            assert_equal(next[t]++, std::stoi(line.substr(2)));
+        }
+
+        for(int t = 0; t < threads; ++t) {
+            assert_equal(per_thread, next[t]);
+        }
+
+        // Reopening carries on in a new segment
+        kfs::AppendLog log(dir, "audit", options);
+        assert_equal(segments + 1, log.segment());
+        log.close();
+        assert_raises(kfs::IOError, [&]() { log.append("late"); });
+    }
+
+    void test_append_log_crash() {
+        auto dir = kfs::path::join(root_, "crashed");
+        kfs::make_dirs(dir);
+
+        kfs::AppendLogOptions options;
+        options.segment_size = 1024 * 1024;
+
+        // Die without closing, so nothing gets trimmed on the way out
+        pid_t child = fork();
+        if(child == 0) {
+            kfs::AppendLog log(dir, "log", options);
+            log.append("first\n");
+            log.append("second\n");
+            log.sync();
+            _exit(0);
+        }
+
+        int status = 0;
+        waitpid(child, &status, 0);
+        assert_true(WIFEXITED(status));
+
+        // The segment ends where the records do, not at the reservation
+        auto segment = kfs::path::join(dir, "log.00000001");
+        assert_equal(off_t(13), kfs::lstat(segment).first.size);
+
+        kfs::AppendLog log(dir, "log", options);
+        assert_equal(2u, log.segment());
+        log.close();
+
+        std::string contents;
+        kfs::read_file_parallel(segment, contents);
+        assert_equal(std::string("first\nsecond\n"), contents);
+    }
+
+    void test_append_log_close_race() {
+        auto dir = kfs::path::join(root_, "racing");
+        kfs::make_dirs(dir);
+
+        kfs::AppendLog log(dir);
+        std::atomic<kfs::AppendLog::Sequence> highest{0};
+
+        std::vector<std::thread> writers;
+        for(int t = 0; t < 4; ++t) {
+            writers.push_back(std::thread([&]() {
+                try {
+                    for(;;) {
+                        auto sequence = log.append("record\n");
+                        auto seen = highest.load();
+                        while(sequence > seen && !highest.compare_exchange_weak(seen, sequence)) {}
+                    }
+                } catch(kfs::IOError&) {}
+            }));
+        }
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        log.close();
+
+        for(auto& writer: writers) {
+            writer.join();
+        }
+
+        // Everything that was accepted made it out before close() returned
+        assert_true(highest.load() > 0);
+        assert_equal(highest.load(), log.durable());
+    }
+
+    void test_mapped_writer() {
+        auto file = kfs::path::join(root_, "mapped");
+
+        {
+            // Small enough that the file outgrows the reservation
+            kfs::MappedWriter writer(file, 8192, 4096);
+            for(int i = 0; i < 10000; ++i) {
+                auto line = std::to_string(i) + "\n";
+                memcpy(writer.append(line.size()), line.data(), line.size());
+            }
+            writer.flush();
+            assert_true(writer.capacity() >= writer.size());
+        }
+
+        std::string expected;
+        for(int i = 0; i < 10000; ++i) {
+            expected += std::to_string(i) + "\n";
+        }
+
+        assert_equal(expected.size(), kfs::lstat(file).first.size);
+
+        {
+            kfs::MappedWriter writer(file);
+            assert_equal(expected.size(), writer.size());
+            assert_equal(0, memcmp(writer.data(), expected.data(), expected.size()));
+            memcpy(writer.append(3), "end", 3);
+        }
+
+        assert_equal(expected.size() + 3, kfs::lstat(file).first.size);
+        assert_equal(kfs::hash_bytes((expected + "end").data(), expected.size() + 3), kfs::hash_file(file));
+    }
+
+    void test_content_cache() {
+        auto file = kfs::path::join(root_, "cached");
+        write_file(file, "first");
+
+        kfs::ContentCache cache(1024, std::chrono::milliseconds(0), 1);
+
+        auto a = cache.get(file);
+        auto b = cache.get(file);
+        assert_equal(std::string("first"), *a);
+        assert_true(a == b);
+        assert_equal(1u, cache.hits());
+        assert_equal(1u, cache.misses());
+        assert_equal(5u, cache.bytes_held());
+
+        // Revalidation notices the change, old buffers are untouched
+        write_file(file, "second version");
+        auto c = cache.get(file);
+        assert_equal(std::string("second version"), *c);
+        assert_equal(std::string("first"), *a);
+        assert_equal(14u, cache.bytes_held());
+
+        // Least recently used entries make way for new ones
+        for(int i = 0; i < 10; ++i) {
+            auto other = kfs::path::join(root_, "other" + std::to_string(i));
+            write_file(other, std::string(200, 'x'));
+            cache.get(other);
+        }
+        assert_true(cache.bytes_held() <= 1024);
+        assert_true(cache.entry_count() < 11);
+
+        cache.invalidate(kfs::path::join(root_, "other9"));
+        assert_equal(800u, cache.bytes_held());
+
+        assert_raises(kfs::IOError, std::bind(&kfs::ContentCache::get, &cache, kfs::path::join(root_, "missing")));
+    }
+
+    void test_read_file_parallel() {
+        auto file = kfs::path::join(root_, "large");
+
+        std::string expected;
+        for(int i = 0; expected.size() < 300000; ++i) {
+            expected += std::to_string(i) + ",";
+        }
+        write_file(file, expected);
+
+        kfs::ReadOptions options;
+        options.chunk_size = 1;  // Rounded up to a page, so lots of chunks
+        options.threads = 4;
+
+        std::string buffer;
+        auto stats = kfs::read_file_parallel(file, buffer, options);
+        assert_equal(expected.size(), stats.bytes);
+        assert_true(buffer == expected);
+
+        std::vector<char> partial(1000);
+        stats = kfs::read_file_parallel(file, partial.data(), partial.size(), options);
+        assert_equal(1000u, stats.bytes);
+        assert_true(std::equal(partial.begin(), partial.end(), expected.begin()));
+
+        assert_raises(kfs::IOError, std::bind(
+            (kfs::ReadStats (*)(const kfs::Path&, std::string&, const kfs::ReadOptions&)) &kfs::read_file_parallel,
+            kfs::path::join(root_, "missing"), std::ref(buffer), options
+        ));
+    }
+
+    void test_prefetch() {
+        auto assets = kfs::path::join(root_, "assets");
+        kfs::make_dirs(kfs::path::join(assets, "textures"));
+        write_file(kfs::path::join(assets, "a"), std::string(1000, 'a'));
+        write_file(kfs::path::join(assets, "textures/b"), std::string(3000, 'b'));
+
+        auto stats = kfs::prefetch(assets);
+        assert_equal(2u, stats.files);
+        assert_equal(4000u, stats.bytes);
+
+        kfs::PrefetchOptions options;
+        options.threads = 1;
+        options.max_bytes = 1500;
+
+        stats = kfs::prefetch(std::vector<kfs::Path>{
+            kfs::path::join(assets, "a"), kfs::path::join(assets, "textures/b"), kfs::path::join(assets, "missing")
+        }, options);
+        assert_equal(2u, stats.files);
+        assert_equal(1500u, stats.bytes);
+        assert_equal(0u, stats.failed);
+
+        stats = kfs::evict(assets);
+        assert_equal(2u, stats.files);
+        assert_equal(4000u, stats.bytes);
+    }
+
+    void test_load_files() {
+        std::vector<kfs::Path> paths;
+        for(int i = 0; i < 50; ++i) {
+            paths.push_back(kfs::path::join(root_, "config" + std::to_string(i)));
+            write_file(paths.back(), "value=" + std::to_string(i));
+        }
+        paths.push_back(kfs::path::join(root_, "missing"));
+        paths.push_back(kfs::path::join(root_, "subfolder"));
+
+        std::vector<char> arena;
+        auto files = kfs::load_files(paths, arena, 4);
+
+        assert_equal(paths.size(), files.size());
+        for(int i = 0; i < 50; ++i) {
+            assert_equal(paths[i], files[i].path);
+            assert_equal(0, files[i].error);
+            assert_equal("value=" + std::to_string(i), std::string(files[i].data, files[i].size));
+        }
+
+        assert_equal(ENOENT, files[50].error);
+        assert_equal(EISDIR, files[51].error);
+        assert_true(files[1].data == files[0].data + files[0].size);
+    }
+
+    void test_watcher() {
+        auto watched = kfs::path::join(root_, "watched");
+        kfs::make_dirs(watched);
+
+        kfs::Watcher watcher(watched, std::chrono::milliseconds(20));
+        auto file = kfs::path::join(watched, "file");
+
+        // Lots of writes to one file arrive as a single event
+        for(int i = 0; i < 10; ++i) {
+            write_file(file, std::to_string(i));
+        }
+
+        auto events = take_until(watcher, file);
+        assert_equal(1u, events.size());
+        assert_equal(file, events[0].path);
+        assert_true(events[0].events & kfs::WATCH_EVENT_CREATED);
+        assert_true(events[0].events & kfs::WATCH_EVENT_MODIFIED);
+
+        // New directories are watched too
+        auto nested = kfs::path::join(watched, "a/b");
+        kfs::make_dirs(nested);
+        write_file(kfs::path::join(nested, "deep"), "x");
+
+        events = take_until(watcher, kfs::path::join(nested, "deep"));
+        assert_true(!events.empty());
+        assert_equal(3u, watcher.watch_count());
+
+        kfs::remove(file);
+        events = take_until(watcher, file);
+        assert_equal(file, events.back().path);
+        assert_true(events.back().events & kfs::WATCH_EVENT_REMOVED);
+
+        // A tree moved in has its directories reported as directories
+        auto outside = kfs::path::join(root_, "outside");
+        kfs::make_dirs(kfs::path::join(outside, "sub"));
+        auto moved = kfs::path::join(watched, "moved");
+        kfs::rename(outside, moved);
+
+        events = take_until(watcher, kfs::path::join(moved, "sub"));
+        assert_equal(kfs::path::join(moved, "sub"), events.back().path);
+        assert_true(events.back().is_dir);
+        assert_equal(5u, watcher.watch_count());
+
+        // Renamed within the tree, events come from the new path
+        auto renamed = kfs::path::join(watched, "renamed");
+        kfs::rename(moved, renamed);
+        take_until(watcher, renamed);
+        write_file(kfs::path::join(renamed, "sub/file"), "x");
+        events = take_until(watcher, kfs::path::join(renamed, "sub/file"));
+        assert_equal(kfs::path::join(renamed, "sub/file"), events.back().path);
+        for(auto& event: events) {
+            assert_true(event.path.find(moved) != 0);
+        }
+
+        // And moved out, it stops being watched
+        kfs::rename(renamed, outside);
+        take_until(watcher, renamed);
+        assert_equal(3u, watcher.watch_count());
+        write_file(kfs::path::join(outside, "sub/file"), "y");
+        assert_true(watcher.take(std::chrono::milliseconds(200)).empty());
+    }
+
+    void test_watcher_max_latency() {
+        auto watched = kfs::path::join(root_, "watched");
+        kfs::make_dirs(watched);
+
+        kfs::Watcher watcher(watched, std::chrono::milliseconds(200), kfs::Watcher::Callback(), std::chrono::milliseconds(100));
+        auto file = kfs::path::join(watched, "file");
+
+        // Never quiet for the debounce window, but delivered all the same
+        std::atomic<bool> writing(true);
+        std::thread writer([&]() {
+            for(int i = 0; i < 100; ++i) {
+                write_file(file, std::to_string(i));
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+            writing = false;
+        });
+
+        auto events = watcher.take(std::chrono::milliseconds(500));
+        bool during = writing;
+        writer.join();
+
+        assert_false(events.empty());
+        assert_true(during);
+    }
+
+    void test_path_store() {
+        kfs::PathStore store;
+
+        auto file = store.insert("/usr/share/doc/readme");
+        auto doc = store.find("/usr/share/doc");
+        auto relative = store.insert("src/main.cpp");
+
+        assert_equal(file, store.insert("/usr/share/doc/readme"));
+        assert_equal(doc, store.parent(file));
+        assert_equal(std::string("readme"), store.name(file));
+        assert_equal(kfs::PathStore::INVALID_ID, store.find("/usr/share/man"));
+        assert_equal(kfs::PathStore::INVALID_ID, store.find("usr/share"));
+
+        assert_equal(kfs::Path("/usr/share/doc/readme"), store.path(file));
+        assert_equal(kfs::Path("src/main.cpp"), store.path(relative));
+        assert_equal(kfs::Path("/"), store.path(store.find("/")));
+        assert_equal(kfs::Path(""), store.path(kfs::PathStore::ROOT));
+
+        char small[8];
+        assert_equal(21u, store.path(file, small, sizeof(small)));
+
+        char buffer[32];
+        assert_equal(21u, store.path(file, buffer, sizeof(buffer)));
+        assert_equal(std::string("/usr/share/doc/readme"), std::string(buffer));
+
+        for(int i = 0; i < 1000; ++i) {
+            store.insert("/usr/share/doc/pkg" + std::to_string(i % 10) + "/file" + std::to_string(i));
+        }
+
+        std::size_t below = 0;
+        store.for_each(store.find("/usr/share/doc/pkg3"), [&](kfs::PathStore::Id) { ++below; });
+        assert_equal(101u, below);
+        assert_equal(kfs::Path("/usr/share/doc/pkg7/file997"), store.path(store.find("/usr/share/doc/pkg7/file997")));
+    }
+
+    void test_split_ext() {
+        assert_equal(kfs::Path("a/b.tar"), kfs::path::split_ext("a/b.tar.gz").first);
+        assert_equal(kfs::Path(".gz"), kfs::path::split_ext("a/b.tar.gz").second);
+        assert_equal(kfs::Path(".txt"), kfs::path::split_ext("file.txt").second);
+        assert_equal(kfs::Path(""), kfs::path::split_ext("a/.hidden").second);
+        assert_equal(kfs::Path(""), kfs::path::split_ext("a.b/c").second);
+        assert_equal(kfs::Path("/usr/bin"), kfs::path::split_ext("/usr/bin").first);
+    }
+
+    void test_constexpr_paths() {
+        static_assert(kfs::path::is_absolute("/usr"), "");
+        static_assert(!kfs::path::is_absolute("usr"), "");
+        static_assert(kfs::path::split_view("/usr/lib").second == "lib", "");
+        static_assert(kfs::path::split_ext_view("a/b.tar.gz").second == ".gz", "");
+        static_assert(std::string_view(kfs::path::static_join("assets", "shaders")) == "assets/shaders", "");
+        static_assert(std::string_view(kfs::path::static_norm_path("/a/./b/../c//")) == "/a/c", "");
+
+        constexpr auto literal = kfs_path("a/../b");
+        static_assert(std::string_view(literal) == "b", "");
+
+        kfs::Path path = kfs_path("textures/../shaders/basic.vert");
+        assert_equal(kfs::Path("shaders/basic.vert"), path);
+        assert_equal(kfs::Path("."), kfs::Path(kfs_path("")));
+        assert_equal(kfs::path::norm_path("../../a/.."), kfs::Path(kfs_path("../../a/..")));
+    }
+
+    void test_pmr_overloads() {
+        // Anything that doesn't come from the buffer throws
+        char buffer[16 * 1024];
+        std::pmr::monotonic_buffer_resource resource(buffer, sizeof(buffer), std::pmr::null_memory_resource());
+
+        const char* paths[] = {"", "/", "//a/b", "///a/../b/", "a/./b/../../..", "../x.tar.gz", "/usr/lib/"};
+        for(auto path: paths) {
+            assert_equal(kfs::path::norm_path(path), std::string(kfs::path::norm_path(path, &resource)));
+            assert_equal(kfs::path::dir_name(path), std::string(kfs::path::dir_name(path, &resource)));
+            assert_equal(kfs::path::split(path).second, std::string(kfs::path::split(path, &resource).second));
+            assert_equal(kfs::path::split_ext(path).first, std::string(kfs::path::split_ext(path, &resource).first));
+        }
+
+        auto joined = kfs::path::join(root_, "subfolder", &resource);
+        assert_equal(kfs::path::join(root_, "subfolder"), std::string(joined));
+
+        auto names = kfs::path::list_dir(joined, &resource);
+        std::vector<std::string> copied(names.begin(), names.end());
+        assert_items_equal(kfs::path::list_dir(kfs::path::join(root_, "subfolder")), copied);
+    }
+
 private:
+    /* Collects watcher events until one for path shows up, or gives up */
+    std::vector<kfs::WatchEvent> take_until(kfs::Watcher& watcher, const kfs::Path& path) {
+        std::vector<kfs::WatchEvent> events;
+        auto give_up = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+
+        while(std::chrono::steady_clock::now() < give_up) {
+            for(auto& event: watcher.take(std::chrono::milliseconds(100))) {
+                events.push_back(event);
+                if(event.path == path) {
+                    return events;
+                }
+            }
+        }
+        return events;
+    }
+
+    void write_file(const kfs::Path& path, const std::string& contents) {
+        std::ofstream file(path.c_str(), std::ios::binary | std::ios::trunc);
+        file << contents;
+    }
+
     kfs::Path root_;
 };